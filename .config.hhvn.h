@@ -3,10 +3,17 @@ static char *yanker = "xclip";
 static char *normsep = "│";
 static char *toolong = ">";
 static int parallelplumb = 1;
+static int plumbfetch = 1;
 static int stimeout = 5;
 static int regexflags = REG_ICASE|REG_EXTENDED;
 static int autotls = 1;
 static int mdhilight = 1;
+static size_t cachemax = 64 * 1024 * 1024;
+static int diskcache = 1;
+static size_t diskcachemax = 256 * 1024 * 1024;
+static int prefetch = 1;
+static size_t prefetchmax = 4 * 1024 * 1024;
+static size_t indexmax = 8 * 1024 * 1024;
 
 static short bar_pair[2] = {-1,  0};
 static short uri_pair[2] = {0,   7};
@@ -20,6 +27,11 @@ static Elem start_page[] = {
 	LINK('1', "hlirc.net", "", "hlirc.net", "70"),
 };
 
+static Expiry expiry[] = {
+	{'0', 24 * 60 * 60},
+	{'1', 60 * 60},
+};
+
 enum Bindings {
 	BIND_URI = ':',
 	BIND_DISPLAY = '+',
@@ -39,6 +51,7 @@ enum Bindings {
 	BIND_ROOT = 'r',
 	BIND_HELP = 'z',
 	BIND_HISTORY = 'h',
+	BIND_FULLTEXT = 'f',
 };
 
 static Scheme scheme[] = {
@@ -0,0 +1,434 @@
+/*
+ * zygo/bench.c
+ *
+ * Copyright (c) 2022 hhvn <dev@hhvn.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/* Run by make bench: serves generated pages on localhost and times
+ * zygo -d fetching them. Nothing here is part of zygo itself. */
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#ifdef TLS
+#include <tls.h>
+#endif /* TLS */
+
+typedef struct {
+	char *name;
+	char *selector;
+	char type;
+	char *body;
+	size_t len;
+} Page;
+
+struct {
+	int runs;
+	int lines;
+	int width;
+	int latency; /* ms before the server answers */
+} opts = {50, 1000, 80, 0};
+
+char *zygo;
+Page pages[2];
+#ifdef TLS
+char certdir[] = "/tmp/zygo-bench.XXXXXX";
+#endif /* TLS */
+
+void
+die(char *msg) {
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+void *
+emalloc(size_t size) {
+	void *ret;
+
+	if ((ret = malloc(size)) == NULL)
+		die("malloc()");
+	return ret;
+}
+
+void
+usage(char *argv0) {
+	fprintf(stderr, "usage: %s [-n runs] [-s lines] [-w width] [-l latency] zygo\n", basename(argv0));
+	exit(EXIT_FAILURE);
+}
+
+double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Fills in a menu and a text document of opts.lines
+ * lines, each about opts.width characters wide */
+void
+makepages(int port) {
+	char *p, fill[4096];
+	int i;
+
+	memset(fill, 'x', sizeof(fill));
+	if ((size_t)opts.width > sizeof(fill) - 1)
+		opts.width = sizeof(fill) - 1;
+
+	pages[0].name = "menu";
+	pages[0].selector = "/menu";
+	pages[0].type = '1';
+	pages[0].body = p = emalloc(opts.lines * (opts.width + 64) + 4);
+	for (i = 0; i < opts.lines; i++)
+		p += sprintf(p, "%c%.*s\t/p%d\t127.0.0.1\t%d\r\n", i % 4 ? '0' : 'i',
+				opts.width, fill, i, port);
+	p += sprintf(p, ".\r\n");
+	pages[0].len = p - pages[0].body;
+
+	pages[1].name = "text";
+	pages[1].selector = "/text";
+	pages[1].type = '0';
+	pages[1].body = p = emalloc(opts.lines * (opts.width + 2) + 4);
+	for (i = 0; i < opts.lines; i++)
+		p += sprintf(p, "%.*s\r\n", opts.width, fill);
+	p += sprintf(p, ".\r\n");
+	pages[1].len = p - pages[1].body;
+}
+
+#ifdef TLS
+/* Makes a self-signed certificate with openssl(1) */
+int
+makecert(void) {
+	char cmd[BUFSIZ];
+
+	if (!mkdtemp(certdir))
+		return -1;
+	snprintf(cmd, sizeof(cmd), "openssl req -x509 -newkey rsa:2048 -nodes "
+			"-days 1 -subj /CN=localhost -keyout %s/key.pem "
+			"-out %s/cert.pem >/dev/null 2>&1", certdir, certdir);
+	return system(cmd) == 0 ? 0 : -1;
+}
+
+void
+rmcert(void) {
+	char path[BUFSIZ];
+
+	snprintf(path, sizeof(path), "%s/key.pem", certdir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/cert.pem", certdir);
+	unlink(path);
+	rmdir(certdir);
+}
+#endif /* TLS */
+
+/* Answers one request at a time on fd until killed */
+void
+serve(int fd, int tls) {
+	struct timespec delay;
+	char buf[BUFSIZ], *nl;
+	ssize_t n;
+	size_t len, off;
+	Page *p;
+	int c, i;
+#ifdef TLS
+	struct tls *ctx = NULL, *cctx;
+	struct tls_config *conf;
+	char path[BUFSIZ];
+
+	if (tls) {
+		if ((ctx = tls_server()) == NULL || (conf = tls_config_new()) == NULL)
+			exit(EXIT_FAILURE);
+		snprintf(path, sizeof(path), "%s/cert.pem", certdir);
+		tls_config_set_cert_file(conf, path);
+		snprintf(path, sizeof(path), "%s/key.pem", certdir);
+		tls_config_set_key_file(conf, path);
+		if (tls_configure(ctx, conf) == -1) {
+			fprintf(stderr, "tls_configure(): %s\n", tls_error(ctx));
+			exit(EXIT_FAILURE);
+		}
+	}
+#else
+	(void)tls;
+#endif /* TLS */
+
+	delay.tv_sec = opts.latency / 1000;
+	delay.tv_nsec = opts.latency % 1000 * 1000000;
+
+	for (;;) {
+		if ((c = accept(fd, NULL, NULL)) == -1)
+			continue;
+#ifdef TLS
+		if (tls && tls_accept_socket(ctx, &cctx, c) == -1) {
+			close(c);
+			continue;
+		}
+#endif /* TLS */
+
+		for (len = 0; len < sizeof(buf) - 1; len += n) {
+#ifdef TLS
+			if (tls)
+				n = tls_read(cctx, buf + len, sizeof(buf) - 1 - len);
+			else
+#endif /* TLS */
+				n = read(c, buf + len, sizeof(buf) - 1 - len);
+			if (n <= 0 || memchr(buf + len, '\n', n)) {
+				len += n > 0 ? n : 0;
+				break;
+			}
+		}
+		buf[len] = '\0';
+		if ((nl = strpbrk(buf, "\r\n")))
+			*nl = '\0';
+
+		for (p = NULL, i = 0; i < (int)(sizeof(pages) / sizeof(pages[0])); i++)
+			if (strcmp(buf, pages[i].selector) == 0)
+				p = &pages[i];
+
+		if (opts.latency)
+			nanosleep(&delay, NULL);
+
+		for (off = 0; p && off < p->len; off += n) {
+#ifdef TLS
+			if (tls)
+				n = tls_write(cctx, p->body + off, p->len - off);
+			else
+#endif /* TLS */
+				n = write(c, p->body + off, p->len - off);
+			if (n <= 0)
+				break;
+		}
+
+#ifdef TLS
+		if (tls) {
+			tls_close(cctx);
+			tls_free(cctx);
+		}
+#endif /* TLS */
+		close(c);
+	}
+}
+
+/* Makes the pages and starts a server for them
+ * in a child, returning its pid */
+pid_t
+server(int tls, int *port) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	pid_t pid;
+	int fd, one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		die("socket()");
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			listen(fd, 16) == -1 ||
+			getsockname(fd, (struct sockaddr *)&addr, &len) == -1)
+		die("bind()");
+	*port = ntohs(addr.sin_port);
+	makepages(*port);
+
+	switch ((pid = fork())) {
+	case -1:
+		die("fork()");
+		break; /* not reached */
+	case 0:
+		serve(fd, tls);
+		exit(EXIT_SUCCESS);
+	}
+	close(fd);
+	return pid;
+}
+
+/* Runs zygo -d on uri, returning its exit status. With
+ * syscalls, it's traced, and every syscall of every
+ * thread is counted there. */
+int
+fetch(char *uri, int tls, struct rusage *ru, long *syscalls) {
+	pid_t pid, w;
+	int status, fd, sig;
+
+	switch ((pid = fork())) {
+	case -1:
+		die("fork()");
+		break; /* not reached */
+	case 0:
+		if ((fd = open("/dev/null", O_RDWR)) == -1)
+			exit(127);
+		dup2(fd, 0);
+		dup2(fd, 1);
+		if (syscalls) {
+			if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1)
+				exit(126);
+			raise(SIGSTOP);
+		}
+		execl(zygo, zygo, tls ? "-kd" : "-d", uri, NULL);
+		exit(127);
+	}
+
+	if (!syscalls) {
+		if (wait4(pid, &status, 0, ru) == -1)
+			die("wait4()");
+		return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	}
+
+	*syscalls = 0;
+	if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status))
+		return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	ptrace(PTRACE_SETOPTIONS, pid, NULL,
+			PTRACE_O_TRACESYSGOOD|PTRACE_O_TRACECLONE|PTRACE_O_EXITKILL);
+	ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+	while ((w = waitpid(-1, &status, __WALL)) != -1) {
+		if (w == pid && (WIFEXITED(status) || WIFSIGNALED(status)))
+			break;
+		if (!WIFSTOPPED(status))
+			continue;
+		sig = 0;
+		if (WSTOPSIG(status) == (SIGTRAP|0x80))
+			(*syscalls)++; /* entry and exit */
+		else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP)
+			sig = WSTOPSIG(status);
+		ptrace(PTRACE_SYSCALL, w, NULL, (void *)(long)sig);
+	}
+	*syscalls /= 2;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int
+dblcmp(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+double
+percentile(double *ms, int n, int pct) {
+	int i = (n * pct + 99) / 100 - 1;
+
+	return ms[i < 0 ? 0 : i];
+}
+
+void
+bench(int tls) {
+	struct rusage ru;
+	pid_t pid;
+	Page *p;
+	char uri[BUFSIZ], syscalls[32];
+	double *ms, start, total;
+	long maxrss, count;
+	int port, i, r;
+
+	pid = server(tls, &port);
+	ms = emalloc(opts.runs * sizeof(double));
+
+	for (p = pages; p < pages + sizeof(pages) / sizeof(pages[0]); p++) {
+		snprintf(uri, sizeof(uri), "%s://127.0.0.1:%d/%c%s",
+				tls ? "gophers" : "gopher", port, p->type, p->selector);
+
+		for (maxrss = 0, total = 0, i = 0; i < opts.runs; i++) {
+			start = now();
+			if ((r = fetch(uri, tls, &ru, NULL)) != 0) {
+				fprintf(stderr, "%s exited with %d fetching %s\n", zygo, r, uri);
+				kill(pid, SIGTERM);
+				exit(EXIT_FAILURE);
+			}
+			ms[i] = now() - start;
+			total += ms[i];
+			if (ru.ru_maxrss > maxrss)
+				maxrss = ru.ru_maxrss;
+		}
+		qsort(ms, opts.runs, sizeof(double), dblcmp);
+
+		if (fetch(uri, tls, NULL, &count) == 0)
+			snprintf(syscalls, sizeof(syscalls), "%ld", count);
+		else
+			snprintf(syscalls, sizeof(syscalls), "-"); /* no ptrace */
+
+		printf("%-6s %-5s %9zu %8.2f %8.2f %8.2f %8.2f %9.2f %9s %9ld\n",
+				tls ? "tls" : "plain", p->name, p->len,
+				percentile(ms, opts.runs, 50), percentile(ms, opts.runs, 90),
+				percentile(ms, opts.runs, 99), ms[opts.runs - 1],
+				p->len * opts.runs / (total / 1000) / (1024 * 1024),
+				syscalls, maxrss);
+		fflush(stdout);
+		free(p->body);
+	}
+
+	free(ms);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+int
+main(int argc, char *argv[]) {
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:w:l:")) != -1) {
+		switch (c) {
+		case 'n':
+			opts.runs = atoi(optarg);
+			break;
+		case 's':
+			opts.lines = atoi(optarg);
+			break;
+		case 'w':
+			opts.width = atoi(optarg);
+			break;
+		case 'l':
+			opts.latency = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || opts.runs < 1 || opts.lines < 0 ||
+			opts.width < 0 || opts.latency < 0)
+		usage(argv[0]);
+	zygo = argv[optind];
+
+	printf("%d runs of %d lines, %d wide, %dms latency\n",
+			opts.runs, opts.lines, opts.width, opts.latency);
+	printf("%-6s %-5s %9s %8s %8s %8s %8s %9s %9s %9s\n",
+			"conn", "page", "bytes", "p50ms", "p90ms", "p99ms",
+			"maxms", "MB/s", "syscalls", "maxrssKB");
+	bench(0);
+#ifdef TLS
+	if (makecert() == -1) {
+		fprintf(stderr, "could not make a certificate with openssl, skipping TLS\n");
+		return 0;
+	}
+	bench(1);
+	rmcert();
+#endif /* TLS */
+	return 0;
+}
@@ -3,10 +3,17 @@ static char *yanker = "xclip";
 static char *normsep = "│"; /* separates link number/info and description */
 static char *toolong = ">"; /* line is too long to fit in terminal */
 static int parallelplumb = 0;
+static int plumbfetch = 0;  /* download binary items and plumb the file */
 static int stimeout = 5;
 static int regexflags = REG_ICASE|REG_EXTENDED;
 static int mdhilight = 0; /* attempt to hilight markdown headers */
 static int autotls = 0;   /* automatically try to establish TLS connections */
+static size_t cachemax = 32 * 1024 * 1024; /* memory for pages kept for back/history */
+static int diskcache = 0;  /* keep responses in $XDG_CACHE_HOME/zygo */
+static size_t diskcachemax = 128 * 1024 * 1024;
+static int prefetch = 0;    /* fetch links on screen in the background */
+static size_t prefetchmax = 4 * 1024 * 1024; /* ...up to this much per page */
+static size_t indexmax = 8 * 1024 * 1024; /* memory for the words of pages visited */
 
 static short bar_pair[2] = {-1,  0};
 static short uri_pair[2] = {0,   7};
@@ -26,6 +33,15 @@ static Elem start_page[] = {
 	INFO("Type 'h' to read the man page."),
 };
 
+/* How long a page in the disk cache is used without
+ * refetching it, by type. If a page can't be fetched,
+ * the cached copy is shown regardless of its age.
+ * Types that aren't listed are never stored. */
+static Expiry expiry[] = {
+	{'0', 24 * 60 * 60},
+	{'1', 60 * 60},
+};
+
 /* Some bindings are still hardcoded in zygo.c */
 enum Bindings {
 	BIND_URI = ':',
@@ -46,6 +62,7 @@ enum Bindings {
 	BIND_ROOT = 'r',
 	BIND_HELP = 'h',
 	BIND_HISTORY = 'H',
+	BIND_FULLTEXT = 'f',
 };
 
 static Scheme scheme[] = {
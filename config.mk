@@ -0,0 +1,7 @@
+# Generated by configure
+# no TLS configured
+# install libretls or libtls (standalone tls.h implementation) for TLS
+SRC	+= plain.c
+# linking an included version of strlcat, as your system doesn't have it
+CFLAGS	+= -DZYGO_STRLCAT
+SRC	+= strlcat.c
@@ -0,0 +1,175 @@
+/*
+ * zygo/dialtest.c
+ *
+ * Copyright (c) 2022 hhvn <dev@hhvn.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/* Run by make dialtest: checks that net_dial(), which is included
+ * here, moves on from an address that never answers to the next
+ * one after CONNDELAY ms. Both are on loopback, so nothing depends
+ * on the network: the first is a listener whose backlog is full,
+ * so the kernel drops the SYNs sent to it, and the second accepts.
+ * The host's lookup is filled in by hand. */
+
+#define _DEFAULT_SOURCE
+#include <limits.h>
+#include <stdarg.h>
+#include <libgen.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "net.c"
+
+#define RUNS 5
+#define SLACK 100 /* ms allowed past CONNDELAY */
+
+void *
+emalloc(size_t size) {
+	void *ret;
+
+	if ((ret = malloc(size)) == NULL) {
+		perror("malloc()");
+		exit(EXIT_FAILURE);
+	}
+	return ret;
+}
+
+char *
+estrdup(const char *str) {
+	char *ret;
+
+	if ((ret = strdup(str)) == NULL) {
+		perror("strdup()");
+		exit(EXIT_FAILURE);
+	}
+	return ret;
+}
+
+void
+error(char *format, ...) {
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+/* Returns a listener on 127.0.0.1, putting its address in sin */
+int
+listener(struct sockaddr_in *sin, int backlog) {
+	socklen_t len = sizeof(struct sockaddr_in);
+	int fd;
+
+	memset(sin, 0, sizeof(struct sockaddr_in));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+			bind(fd, (struct sockaddr *)sin, len) == -1 ||
+			listen(fd, backlog) == -1 ||
+			getsockname(fd, (struct sockaddr *)sin, &len) == -1) {
+		perror("listener");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+/* Connects to sin without accepting, until connecting no longer
+ * completes within CONNDELAY. Returns 0 once it doesn't. */
+int
+fill(struct sockaddr_in *sin) {
+	struct pollfd pfd;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		if ((pfd.fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+			break;
+		fcntl(pfd.fd, F_SETFL, O_NONBLOCK);
+		if (connect(pfd.fd, (struct sockaddr *)sin, sizeof(struct sockaddr_in)) == 0)
+			continue;
+		if (errno != EINPROGRESS)
+			break;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, CONNDELAY) == 0) {
+			close(pfd.fd);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int
+main(int argc, char *argv[]) {
+	struct sockaddr_in dead, live, peer;
+	struct addrinfo ai[2];
+	Elem e = {0, '1', "", "", "dialtest", "70", 0, NULL};
+	Host h;
+	socklen_t len;
+	long start, took, worst = 0;
+	int i, fd, ret = EXIT_SUCCESS;
+
+	if (argc > 1) {
+		fprintf(stderr, "usage: %s\n", basename(argv[0]));
+		return EXIT_FAILURE;
+	}
+
+	listener(&dead, 0);
+	listener(&live, 16);
+	if (fill(&dead) == -1) {
+		fprintf(stderr, "could not fill the backlog of 127.0.0.1:%d\n", ntohs(dead.sin_port));
+		return EXIT_FAILURE;
+	}
+
+	memset(ai, 0, sizeof(ai));
+	for (i = 0; i < 2; i++) {
+		ai[i].ai_family = AF_INET;
+		ai[i].ai_socktype = SOCK_STREAM;
+		ai[i].ai_addrlen = sizeof(struct sockaddr_in);
+		ai[i].ai_addr = (struct sockaddr *)(i ? &live : &dead);
+	}
+	ai[0].ai_next = &ai[1];
+
+	h.server = e.server;
+	h.port = e.port;
+	h.ai = ai;
+	h.expires = LONG_MAX;
+	h.state = HOST_DONE;
+	h.next = NULL;
+	resolver.hosts = &h;
+	resolver.nhosts = 1;
+
+	for (i = 0; i < RUNS; i++) {
+		start = net_ms();
+		fd = net_dial(&e, 0);
+		took = net_ms() - start;
+		worst = took > worst ? took : worst;
+
+		len = sizeof(peer);
+		if (fd == -1 || getpeername(fd, (struct sockaddr *)&peer, &len) == -1 ||
+				peer.sin_port != live.sin_port) {
+			fprintf(stderr, "run %d: did not connect to 127.0.0.1:%d\n", i, ntohs(live.sin_port));
+			ret = EXIT_FAILURE;
+		} else if (took > CONNDELAY + SLACK) {
+			fprintf(stderr, "run %d: took %ldms, more than %dms\n", i, took, CONNDELAY + SLACK);
+			ret = EXIT_FAILURE;
+		}
+		if (fd != -1)
+			close(fd);
+	}
+
+	printf("net_dial: %d runs, slowest %ldms (CONNDELAY %dms): %s\n",
+			RUNS, worst, CONNDELAY, ret == EXIT_SUCCESS ? "ok" : "FAILED");
+	return ret;
+}
@@ -0,0 +1,606 @@
+/*
+ * zygo/match.c
+ *
+ * Copyright (c) 2022 hhvn <dev@hhvn.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/* Search patterns. Those without any special characters are
+ * found with strstr()/strcspn(), which libcs vectorize, and
+ * other extended regexes run on a Thompson NFA, which takes
+ * time linear in the length of the line. Anything the NFA
+ * can't do (backreferences, collating elements, non-ASCII
+ * case folding, basic regexes...) is left to regexec(). */
+
+#include <ctype.h>
+#include <langinfo.h>
+#include <poll.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "zygo.h"
+
+#define SPECIAL "\\^$.[]|()*+?{}"
+#define SETBIT(set, c) ((set)[(unsigned char)(c) / 8] |= 1 << ((unsigned char)(c) % 8))
+#define HASBIT(set, c) ((set)[(unsigned char)(c) / 8] & (1 << ((unsigned char)(c) % 8)))
+
+/* Parser state, see match_parse() */
+typedef struct {
+	const char *p;
+	Renode nodes[MATCHNODES];
+	int nnodes;
+	int icase;
+	int utf8;
+} Parser;
+
+static Renode *parse_alt(Parser *ps);
+
+static Renode *
+node(Parser *ps, int type, Renode *l, Renode *r) {
+	Renode *n;
+
+	if (ps->nnodes == MATCHNODES)
+		return NULL;
+	n = &ps->nodes[ps->nnodes++];
+	memset(n, 0, sizeof(Renode));
+	n->type = type;
+	n->l = l;
+	n->r = r;
+	return n;
+}
+
+static void
+setchar(Parser *ps, unsigned char *set, int c) {
+	SETBIT(set, c);
+	if (ps->icase && isalpha(c)) {
+		SETBIT(set, tolower(c));
+		SETBIT(set, toupper(c));
+	}
+}
+
+/* Character classes, ASCII only: most also
+ * have other characters in UTF-8 locales */
+static int
+setclass(Parser *ps, unsigned char *set, const char *name, size_t len) {
+	static const struct {
+		const char *name;
+		int (*fn)(int);
+	} classes[] = {
+		{"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum},
+		{"upper", isupper}, {"lower", islower}, {"space", isspace},
+		{"blank", isblank}, {"punct", ispunct}, {"print", isprint},
+		{"graph", isgraph}, {"cntrl", iscntrl}, {"xdigit", isxdigit},
+	};
+	size_t i;
+	int c;
+
+	for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+		if (strlen(classes[i].name) == len && strncmp(classes[i].name, name, len) == 0) {
+			if (ps->utf8 && classes[i].fn != isdigit && classes[i].fn != isxdigit)
+				return -1;
+			for (c = 1; c < 128; c++)
+				if (classes[i].fn(c))
+					setchar(ps, set, c);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static Renode *
+parse_bracket(Parser *ps) {
+	Renode *n;
+	const char *end;
+	int c, neg = 0, first = 1;
+
+	if (!(n = node(ps, RE_SET, NULL, NULL)))
+		return NULL;
+
+	if (*ps->p == '^') {
+		neg = 1;
+		ps->p++;
+	}
+
+	for (; *ps->p && (first || *ps->p != ']'); first = 0) {
+		c = (unsigned char)*ps->p;
+		if (c >= 0x80)
+			return NULL;
+		if (c == '[' && ps->p[1] == ':') {
+			if (!(end = strstr(ps->p + 2, ":]")) ||
+					setclass(ps, n->set, ps->p + 2, end - ps->p - 2) == -1)
+				return NULL;
+			ps->p = end + 2;
+		} else if (c == '[' && (ps->p[1] == '.' || ps->p[1] == '=')) {
+			return NULL; /* collating elements */
+		} else if (ps->p[1] == '-' && ps->p[2] && ps->p[2] != ']') {
+			if ((unsigned char)ps->p[2] >= 0x80 || ps->p[2] < c)
+				return NULL;
+			for (; c <= ps->p[2]; c++)
+				setchar(ps, n->set, c);
+			ps->p += 3;
+		} else {
+			setchar(ps, n->set, c);
+			ps->p++;
+		}
+	}
+	if (*ps->p != ']')
+		return NULL;
+	ps->p++;
+
+	if (neg) {
+		for (c = 0; c < 32; c++)
+			n->set[c] = ~n->set[c];
+		n->set[0] &= ~1; /* never NUL */
+		if (ps->utf8) {
+			/* any other character: a lead byte,
+			 * and its continuation bytes */
+			for (c = 0x80; c < 0xc0; c++)
+				n->set[c / 8] &= ~(1 << (c % 8));
+			n->multibyte = 1;
+		}
+	}
+	return n;
+}
+
+static Renode *
+parse_atom(Parser *ps) {
+	Renode *n, *cat;
+	int c, i, len;
+
+	switch (c = (unsigned char)*ps->p) {
+	case '(':
+		ps->p++;
+		if (*ps->p == ')')
+			n = node(ps, RE_EMPTY, NULL, NULL);
+		else
+			n = parse_alt(ps);
+		if (!n || *ps->p != ')')
+			return NULL;
+		ps->p++;
+		return n;
+	case '[':
+		ps->p++;
+		return parse_bracket(ps);
+	case '.':
+		ps->p++;
+		if (!(n = node(ps, RE_SET, NULL, NULL)))
+			return NULL;
+		memset(n->set, 0xff, sizeof(n->set));
+		n->set[0] &= ~1;
+		if (ps->utf8) {
+			for (c = 0x80; c < 0xc0; c++)
+				n->set[c / 8] &= ~(1 << (c % 8));
+			n->multibyte = 1;
+		}
+		return n;
+	case '^':
+		ps->p++;
+		return node(ps, RE_BOL, NULL, NULL);
+	case '$':
+		ps->p++;
+		return node(ps, RE_EOL, NULL, NULL);
+	case '\\':
+		/* only escaped punctuation: \w, \1 etc. aren't ours */
+		c = (unsigned char)ps->p[1];
+		if (!c || c >= 0x80 || isalnum(c))
+			return NULL;
+		ps->p += 2;
+		if (!(n = node(ps, RE_SET, NULL, NULL)))
+			return NULL;
+		setchar(ps, n->set, c);
+		return n;
+	case '*': case '+': case '?': case '{':
+	case '|': case ')': case '\0':
+		return NULL;
+	}
+
+	if (c >= 0x80) {
+		/* a whole character, so repetition applies to it */
+		if (ps->icase || !ps->utf8)
+			return NULL;
+		len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+		for (cat = NULL, i = 0; i < len; i++) {
+			if (!ps->p[i] || !(n = node(ps, RE_SET, NULL, NULL)))
+				return NULL;
+			SETBIT(n->set, ps->p[i]);
+			cat = cat ? node(ps, RE_CAT, cat, n) : n;
+		}
+		ps->p += len;
+		return cat;
+	}
+
+	ps->p++;
+	if (!(n = node(ps, RE_SET, NULL, NULL)))
+		return NULL;
+	setchar(ps, n->set, c);
+	return n;
+}
+
+static Renode *
+parse_repeat(Parser *ps) {
+	Renode *n;
+	char *end;
+	long min, max;
+
+	if (!(n = parse_atom(ps)))
+		return NULL;
+
+	for (;;) {
+		switch (*ps->p) {
+		case '*':
+			min = 0, max = -1;
+			ps->p++;
+			break;
+		case '+':
+			min = 1, max = -1;
+			ps->p++;
+			break;
+		case '?':
+			min = 0, max = 1;
+			ps->p++;
+			break;
+		case '{':
+			if (!isdigit((unsigned char)ps->p[1]))
+				return NULL;
+			min = max = strtol(ps->p + 1, &end, 10);
+			if (*end == ',') {
+				if (isdigit((unsigned char)end[1]))
+					max = strtol(end + 1, &end, 10);
+				else
+					max = -1, end++;
+			}
+			if (*end != '}' || min > MATCHPROG || max > MATCHPROG ||
+					(max != -1 && max < min))
+				return NULL;
+			ps->p = end + 1;
+			break;
+		default:
+			return n;
+		}
+
+		if (!(n = node(ps, RE_REPEAT, n, NULL)))
+			return NULL;
+		n->min = min;
+		n->max = max;
+	}
+}
+
+static Renode *
+parse_cat(Parser *ps) {
+	Renode *n = NULL, *r;
+
+	while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+		if (!(r = parse_repeat(ps)))
+			return NULL;
+		if (n && !(r = node(ps, RE_CAT, n, r)))
+			return NULL;
+		n = r;
+	}
+
+	return n ? n : node(ps, RE_EMPTY, NULL, NULL);
+}
+
+static Renode *
+parse_alt(Parser *ps) {
+	Renode *n, *r;
+
+	if (!(n = parse_cat(ps)))
+		return NULL;
+	while (*ps->p == '|') {
+		ps->p++;
+		if (!(r = parse_cat(ps)) || !(n = node(ps, RE_ALT, n, r)))
+			return NULL;
+	}
+	return n;
+}
+
+/* Appends an instruction, returning its index, or -1 */
+static int
+emit(Matcher *m, int op) {
+	if (m->nprog == MATCHPROG)
+		return -1;
+	memset(&m->prog[m->nprog], 0, sizeof(Inst));
+	m->prog[m->nprog].op = op;
+	return m->nprog++;
+}
+
+static int
+compile(Matcher *m, Renode *n) {
+	int i, l1, l2, start;
+
+	switch (n->type) {
+	case RE_EMPTY:
+		return 0;
+	case RE_SET:
+		if ((i = emit(m, I_SET)) == -1)
+			return -1;
+		memcpy(m->prog[i].set, n->set, sizeof(n->set));
+		if (n->multibyte) {
+			/* L1: split L2, L3; L2: cont; jmp L1; L3: */
+			if ((l1 = emit(m, I_SPLIT)) == -1 ||
+					emit(m, I_CONT) == -1 ||
+					(i = emit(m, I_JMP)) == -1)
+				return -1;
+			m->prog[i].x = l1;
+			m->prog[l1].x = l1 + 1;
+			m->prog[l1].y = m->nprog;
+		}
+		return 0;
+	case RE_BOL:
+		return emit(m, I_BOL) == -1 ? -1 : 0;
+	case RE_EOL:
+		return emit(m, I_EOL) == -1 ? -1 : 0;
+	case RE_CAT:
+		return compile(m, n->l) == -1 ? -1 : compile(m, n->r);
+	case RE_ALT:
+		/* split L1, L2; L1: l; jmp L3; L2: r; L3: */
+		if ((l1 = emit(m, I_SPLIT)) == -1 || compile(m, n->l) == -1 ||
+				(l2 = emit(m, I_JMP)) == -1)
+			return -1;
+		m->prog[l1].x = l1 + 1;
+		m->prog[l1].y = m->nprog;
+		if (compile(m, n->r) == -1)
+			return -1;
+		m->prog[l2].x = m->nprog;
+		return 0;
+	case RE_REPEAT:
+		for (i = 0; i < n->min; i++)
+			if (compile(m, n->l) == -1)
+				return -1;
+		if (n->max == -1) {
+			/* L1: split L2, L3; L2: l; jmp L1; L3: */
+			if ((l1 = emit(m, I_SPLIT)) == -1 || compile(m, n->l) == -1 ||
+					(l2 = emit(m, I_JMP)) == -1)
+				return -1;
+			m->prog[l2].x = l1;
+			m->prog[l1].x = l1 + 1;
+			m->prog[l1].y = m->nprog;
+			return 0;
+		}
+		for (; i < n->max; i++) {
+			/* split L1, L2; L1: l; L2: */
+			if ((start = emit(m, I_SPLIT)) == -1 || compile(m, n->l) == -1)
+				return -1;
+			m->prog[start].x = start + 1;
+			m->prog[start].y = m->nprog;
+		}
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Adds the bytes that can be consumed first from pc to set */
+static void
+startset(Matcher *m, unsigned char *set, int *seen, int pc) {
+	int i;
+
+	if (seen[pc])
+		return;
+	seen[pc] = 1;
+
+	switch (m->prog[pc].op) {
+	case I_SET:
+		for (i = 0; i < 32; i++)
+			set[i] |= m->prog[pc].set[i];
+		break;
+	case I_SPLIT:
+		startset(m, set, seen, m->prog[pc].x);
+		startset(m, set, seen, m->prog[pc].y);
+		break;
+	case I_JMP:
+		startset(m, set, seen, m->prog[pc].x);
+		break;
+	case I_BOL:
+	case I_EOL:
+		startset(m, set, seen, pc + 1);
+		break;
+	default: /* matches nothing: no need to skip */
+		memset(set, 0xff, 32);
+	}
+}
+
+/* Compiles pattern for the NFA, or returns -1 if it can't be */
+static int
+match_parse(Matcher *m, const char *pattern, int icase) {
+	Parser *ps;
+	Renode *n;
+	char *codeset;
+	int *seen;
+	int ret = -1;
+
+	ps = emalloc(sizeof(Parser));
+	ps->p = pattern;
+	ps->nnodes = 0;
+	ps->icase = icase;
+	ps->utf8 = MB_CUR_MAX > 1;
+	codeset = nl_langinfo(CODESET);
+	if (ps->utf8 && strcmp(codeset, "UTF-8") != 0 && strcmp(codeset, "utf8") != 0)
+		goto end; /* other multibyte encodings */
+
+	m->prog = emalloc(MATCHPROG * sizeof(Inst));
+	m->nprog = 0;
+	if ((n = parse_alt(ps)) && !*ps->p && compile(m, n) == 0 && emit(m, I_MATCH) != -1) {
+		seen = emalloc(m->nprog * sizeof(int));
+		memset(seen, 0, m->nprog * sizeof(int));
+		startset(m, m->start, seen, 0);
+		free(seen);
+		ret = 0;
+	}
+
+	if (ret == -1) {
+		free(m->prog);
+		m->prog = NULL;
+	}
+end:
+	free(ps);
+	return ret;
+}
+
+/* Compiles pattern with regcomp() flags. On failure, the
+ * error is put in err, and -1 is returned. */
+int
+match_compile(Matcher *m, const char *pattern, int flags, char *err, size_t errlen) {
+	const unsigned char *p;
+	int ret, ascii;
+
+	memset(m, 0, sizeof(Matcher));
+	m->icase = flags & REG_ICASE;
+
+	for (ascii = 1, p = (const unsigned char *)pattern; *p; p++)
+		if (*p >= 0x80)
+			ascii = 0;
+
+	if (!strpbrk(pattern, SPECIAL) && (ascii || !m->icase)) {
+		m->kind = MATCH_LITERAL;
+		m->lit = estrdup(pattern);
+		m->litlen = strlen(pattern);
+		m->first[0] = pattern[0];
+		if (m->icase && isalpha((unsigned char)pattern[0])) {
+			m->first[0] = tolower((unsigned char)pattern[0]);
+			m->first[1] = toupper((unsigned char)pattern[0]);
+		}
+		return 0;
+	}
+
+	if ((flags & ~(REG_ICASE|REG_NOSUB)) == REG_EXTENDED &&
+			match_parse(m, pattern, m->icase) == 0) {
+		m->kind = MATCH_NFA;
+		return 0;
+	}
+
+	m->kind = MATCH_REGEX;
+	if ((ret = regcomp(&m->regex, pattern, flags)) != 0) {
+		regerror(ret, &m->regex, err, errlen);
+		return -1;
+	}
+	return 0;
+}
+
+/* Adds pc, and whatever it leads to without
+ * consuming anything, to list for position pos */
+static void
+addthread(Matcher *m, int *list, int *n, int *mark, int gen, int pc, size_t pos, size_t len) {
+	if (mark[pc] == gen)
+		return;
+	mark[pc] = gen;
+
+	switch (m->prog[pc].op) {
+	case I_JMP:
+		addthread(m, list, n, mark, gen, m->prog[pc].x, pos, len);
+		break;
+	case I_SPLIT:
+		addthread(m, list, n, mark, gen, m->prog[pc].x, pos, len);
+		addthread(m, list, n, mark, gen, m->prog[pc].y, pos, len);
+		break;
+	case I_BOL:
+		if (pos == 0)
+			addthread(m, list, n, mark, gen, pc + 1, pos, len);
+		break;
+	case I_EOL:
+		if (pos == len)
+			addthread(m, list, n, mark, gen, pc + 1, pos, len);
+		break;
+	default:
+		list[(*n)++] = pc;
+	}
+}
+
+/* Runs every path through the program at once, starting a
+ * new one at each position, as the match may start anywhere.
+ * When no path is going, bytes that can't start one are
+ * skipped. */
+static int
+match_nfa(Matcher *m, const char *str) {
+	int lists[2][MATCHPROG], mark[MATCHPROG];
+	int *clist = lists[0], *nlist = lists[1], *tmp;
+	int nc = 0, nn, i, pc;
+	size_t len = strlen(str), pos;
+	unsigned char c;
+
+	for (i = 0; i < m->nprog; i++)
+		mark[i] = -1;
+
+	for (pos = 0; ; pos++) {
+		if (nc == 0 && pos > 0)
+			while (pos < len && !HASBIT(m->start, str[pos]))
+				pos++;
+		addthread(m, clist, &nc, mark, pos, 0, pos, len);
+
+		for (i = 0; i < nc; i++)
+			if (m->prog[clist[i]].op == I_MATCH)
+				return 1;
+		if (pos == len)
+			return 0;
+
+		c = str[pos];
+		for (nn = 0, i = 0; i < nc; i++) {
+			pc = clist[i];
+			switch (m->prog[pc].op) {
+			case I_SET:
+				if (HASBIT(m->prog[pc].set, c))
+					addthread(m, nlist, &nn, mark, pos + 1, pc + 1, pos + 1, len);
+				break;
+			case I_CONT:
+				if (c >= 0x80 && c < 0xc0)
+					addthread(m, nlist, &nn, mark, pos + 1, pc + 1, pos + 1, len);
+				break;
+			default:
+				break;
+			}
+		}
+
+		tmp = clist;
+		clist = nlist;
+		nlist = tmp;
+		nc = nn;
+	}
+}
+
+/* Returns 1 if str matches. Safe to call from many threads. */
+int
+match_exec(Matcher *m, const char *str) {
+	const char *p;
+
+	switch (m->kind) {
+	case MATCH_LITERAL:
+		if (!m->icase)
+			return strstr(str, m->lit) != NULL;
+		for (p = str; *(p += strcspn(p, m->first)); p++)
+			if (strncasecmp(p, m->lit, m->litlen) == 0)
+				return 1;
+		return 0;
+	case MATCH_NFA:
+		return match_nfa(m, str);
+	default:
+		return regexec(&m->regex, str, 0, NULL, 0) == 0;
+	}
+}
+
+void
+match_free(Matcher *m) {
+	switch (m->kind) {
+	case MATCH_LITERAL:
+		free(m->lit);
+		break;
+	case MATCH_NFA:
+		free(m->prog);
+		break;
+	default:
+		regfree(&m->regex);
+	}
+	memset(m, 0, sizeof(Matcher));
+}
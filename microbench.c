@@ -0,0 +1,302 @@
+/*
+ * zygo/microbench.c
+ *
+ * Copyright (c) 2022 hhvn <dev@hhvn.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/* Run by make microbench: times functions of zygo.c, which is
+ * included here, on generated pages of up to a million lines.
+ * ncurses draws to /dev/null. Allocations are the calls to
+ * malloc(), realloc() and strdup() made by zygo.c itself. */
+
+#define _XOPEN_SOURCE_EXTENDED
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include <ncurses.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+size_t allocs = 0;
+#define malloc(size) (allocs++, malloc(size))
+#define realloc(ptr, size) (allocs++, realloc(ptr, size))
+#define strdup(str) (allocs++, strdup(str))
+
+/* zygo.c defines these again */
+#undef _XOPEN_SOURCE_EXTENDED
+#undef _XOPEN_SOURCE
+#undef _DEFAULT_SOURCE
+
+#define main zygo_main
+#include "zygo.c"
+#undef main
+#undef malloc
+#undef realloc
+#undef strdup
+
+#define FINDS 3 /* fresh searches timed per size */
+
+typedef struct {
+	char *name;
+	size_t (*run)(size_t n); /* returns ops done */
+} Bench;
+
+char *lines; /* n gopher menu lines, each ending in \0 */
+char *work; /* copy of lines for gophertoelem() */
+size_t lineslen;
+char **uris;
+Elem *elems;
+
+void
+generate(size_t n) {
+	char *p;
+	size_t i;
+
+	lines = p = emalloc(n * 96);
+	for (i = 0; i < n; i++)
+		p += sprintf(p, "%c%s line %zu of the generated page\t/sel/%zu\thost%zu.example.org\t%s",
+				"i01"[i % 3], i % 7 ? "A" : "A much longer and wordier",
+				i, i, i % 100, i % 5 ? "70" : "7070") + 1;
+	lineslen = p - lines;
+	work = emalloc(lineslen);
+	elems = emalloc(n * sizeof(Elem));
+
+	uris = emalloc(n * sizeof(char *));
+	for (i = 0; i < n; i++) {
+		uris[i] = emalloc(64);
+		snprintf(uris[i], 64, "gopher://host%zu.example.org%s/1/sel/%zu",
+				i % 100, i % 5 ? "" : ":7070", i);
+	}
+}
+
+void
+release(size_t n) {
+	size_t i;
+
+	search_free();
+	ui.search = 0;
+	list_free(&page);
+	render_flush();
+	for (i = 0; i < n; i++)
+		free(uris[i]);
+	free(uris);
+	free(lines);
+	free(work);
+	free(elems);
+}
+
+size_t
+b_gophertoelem(size_t n) {
+	char *p;
+	size_t i;
+
+	memcpy(work, lines, lineslen);
+	for (i = 0, p = work; i < n; i++, p += strlen(p) + 1)
+		gophertoelem(&elems[i], NULL, p);
+	return n;
+}
+
+size_t
+b_list_append(size_t n) {
+	size_t i;
+
+	list_free(&page);
+	for (i = 0; i < n; i++)
+		list_append(&page, &elems[i]);
+	return n;
+}
+
+size_t
+b_list_idget(size_t n) {
+	unsigned long x = 1;
+	size_t i, sum = 0;
+
+	for (i = 0; i < n; i++) {
+		x = x * 6364136223846793005UL + 1442695040888963407UL;
+		sum += list_idget(&page, x % page.lastid + 1)->type;
+	}
+	return sum ? n : 0;
+}
+
+size_t
+b_getscheme(size_t n) {
+	size_t i, sum = 0;
+
+	for (i = 0; i < n; i++)
+		sum += getscheme(list_get(&page, i))->type;
+	return sum ? n : 0;
+}
+
+size_t
+b_elemtouri(size_t n) {
+	size_t i, sum = 0;
+
+	for (i = 0; i < n; i++)
+		sum += strlen(elemtouri(list_get(&page, i)));
+	return sum ? n : 0;
+}
+
+size_t
+b_uritoelem(size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		elem_free(uritoelem(uris[i]));
+	return n;
+}
+
+size_t
+b_draw_line(size_t n) {
+	int nwidth = digits(page.lastid);
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		move(i % (LINES - 1), 0);
+		draw_line(list_get(&page, i), nwidth, 0);
+	}
+	return n;
+}
+
+size_t
+b_draw_page(size_t n) {
+	size_t ops = 0;
+
+	for (ui.scroll = 0; (size_t)ui.scroll < n; ui.scroll += LINES - 1, ops++)
+		draw_page();
+	ui.scroll = 0;
+	return ops;
+}
+
+/* A search entered with BIND_SEARCH, for each op */
+size_t
+search(char *pattern) {
+	char err[BUFLEN];
+	int i;
+
+	for (i = 0; i < FINDS; i++) {
+		search_free();
+		if (match_compile(&ui.matcher, pattern, regexflags, err, sizeof(err)) == -1)
+			return 0;
+		ui.search = 1;
+		ui.pattern = estrdup(pattern);
+		ui.scroll = 0;
+		find(0);
+	}
+	ui.scroll = 0;
+	return FINDS;
+}
+
+size_t
+b_find_literal(size_t n) {
+	(void)n;
+	return search("wordier line 9");
+}
+
+size_t
+b_find_regex(size_t n) {
+	(void)n;
+	return search("line [0-9]*99 of.*page");
+}
+
+Bench benches[] = {
+	{"gophertoelem", b_gophertoelem},
+	{"list_append", b_list_append},
+	{"list_idget", b_list_idget},
+	{"getscheme", b_getscheme},
+	{"elemtouri", b_elemtouri},
+	{"uritoelem", b_uritoelem},
+	{"draw_line", b_draw_line},
+	{"draw_page", b_draw_page},
+	{"find literal", b_find_literal},
+	{"find regex", b_find_regex},
+};
+
+double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int
+wanted(Bench *b, int argc, char *argv[]) {
+	int i;
+
+	if (!argc)
+		return 1;
+	for (i = 0; i < argc; i++)
+		if (strncmp(b->name, argv[i], strlen(argv[i])) == 0)
+			return 1;
+	return 0;
+}
+
+int
+main(int argc, char *argv[]) {
+	SCREEN *scr;
+	FILE *in, *out;
+	Bench *b;
+	size_t n, max = 1000000, ops, before;
+	double start;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:")) != -1) {
+		switch (c) {
+		case 'm':
+			max = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m maxlines] [function...]\n", basename(argv[0]));
+			return EXIT_FAILURE;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	setlocale(LC_ALL, "");
+	if (!(in = fopen("/dev/null", "r")) || !(out = fopen("/dev/null", "w")) ||
+			(!(scr = newterm("xterm", out, in)) && !(scr = newterm("vt100", out, in)))) {
+		fprintf(stderr, "could not start ncurses on /dev/null\n");
+		return EXIT_FAILURE;
+	}
+	set_term(scr);
+	scheme_init();
+
+	printf("%-14s %9s %9s %12s %10s\n", "function", "lines", "ops", "ns/op", "allocs/op");
+	for (n = 1000; n <= max; n *= 10) {
+		generate(n);
+		for (b = benches; b < benches + sizeof(benches) / sizeof(benches[0]); b++) {
+			/* the page is made by list_append() */
+			if (!wanted(b, argc, argv) && b->run != b_gophertoelem && b->run != b_list_append)
+				continue;
+			before = allocs;
+			start = now();
+			ops = b->run(n);
+			if (!wanted(b, argc, argv))
+				continue;
+			printf("%-14s %9zu %9zu %12.1f %10.2f\n", b->name, n, ops,
+					ops ? (now() - start) / ops : 0,
+					ops ? (double)(allocs - before) / ops : 0);
+			fflush(stdout);
+		}
+		release(n);
+	}
+
+	endwin();
+	delscreen(scr);
+	return 0;
+}
@@ -0,0 +1,363 @@
+/*
+ * zygo/net.c
+ *
+ * Copyright (c) 2022 hhvn <dev@hhvn.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/* Code shared by plain.c and tls.c */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "zygo.h"
+
+/* Resolver: lookups are done by a pool of threads, and
+ * results (including failures) are kept for a while. Only
+ * the main thread adds or removes hosts, the workers only
+ * fill them in, so a result can be used without the lock
+ * once it's done. */
+struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t workers[RESOLVERS];
+	int started;
+	int notify[2]; /* written to when a lookup completes */
+	Host *hosts;
+	size_t nhosts;
+} resolver = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {0}, 0, {-1, -1}, NULL, 0};
+
+long
+net_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void *
+net_resolver(void *arg) {
+	struct addrinfo hints;
+	Host *h;
+	int ret;
+
+	(void)arg;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	pthread_mutex_lock(&resolver.lock);
+	for (;;) {
+		for (h = resolver.hosts; h && h->state != HOST_QUEUED; h = h->next);
+		if (!h) {
+			pthread_cond_wait(&resolver.cond, &resolver.lock);
+			continue;
+		}
+
+		h->state = HOST_RESOLVING;
+		pthread_mutex_unlock(&resolver.lock);
+		if ((ret = getaddrinfo(h->server, h->port, &hints, &h->ai)) != 0)
+			h->ai = NULL;
+		pthread_mutex_lock(&resolver.lock);
+
+		h->expires = net_ms() + (h->ai ? DNSTTL : DNSNEGTTL);
+		h->state = HOST_DONE;
+		/* if it's full, it's readable anyway */
+		while (write(resolver.notify[1], "", 1) == -1 && errno == EINTR);
+	}
+
+	return NULL;
+}
+
+/* fd that is readable after a lookup completes */
+int
+net_resolvefd(void) {
+	return resolver.started ? resolver.notify[0] : -1;
+}
+
+/* Starts looking up e->server:e->port, unless it has already
+ * been (recently enough). Returns 1 if the lookup hasn't
+ * completed yet, or 0 if net_lookup() won't block. */
+int
+net_resolve(Elem *e) {
+	Host *h, *prev, *old, *oldprev;
+	char c;
+	int i, ret;
+
+	pthread_mutex_lock(&resolver.lock);
+	if (!resolver.started) {
+		if (pipe(resolver.notify) == -1) {
+			perror("pipe()");
+			exit(EXIT_FAILURE);
+		}
+		fcntl(resolver.notify[0], F_SETFL, O_NONBLOCK);
+		fcntl(resolver.notify[1], F_SETFL, O_NONBLOCK);
+		for (i = 0; i < RESOLVERS; i++)
+			pthread_create(&resolver.workers[i], NULL, net_resolver, NULL);
+		resolver.started = 1;
+	}
+	while (read(resolver.notify[0], &c, 1) == 1);
+
+	for (prev = NULL, h = resolver.hosts; h; prev = h, h = h->next) {
+		if (strcmp(h->server, e->server) == 0 && strcmp(h->port, e->port) == 0) {
+			if (h->state == HOST_DONE && h->expires <= net_ms()) {
+				/* expired, look it up again */
+				if (h->ai)
+					freeaddrinfo(h->ai);
+				h->ai = NULL;
+				h->state = HOST_QUEUED;
+				pthread_cond_signal(&resolver.cond);
+			}
+			break;
+		}
+	}
+
+	if (!h) {
+		/* make room by dropping the oldest finished lookup */
+		if (resolver.nhosts >= DNSCACHE) {
+			for (old = oldprev = NULL, prev = NULL, h = resolver.hosts; h; prev = h, h = h->next) {
+				if (h->state == HOST_DONE) {
+					old = h;
+					oldprev = prev;
+				}
+			}
+			if (old) {
+				if (oldprev)
+					oldprev->next = old->next;
+				else
+					resolver.hosts = old->next;
+				if (old->ai)
+					freeaddrinfo(old->ai);
+				free(old->server);
+				free(old->port);
+				free(old);
+				resolver.nhosts--;
+			}
+		}
+
+		h = emalloc(sizeof(Host));
+		h->server = estrdup(e->server);
+		h->port = estrdup(e->port);
+		h->ai = NULL;
+		h->state = HOST_QUEUED;
+		h->next = resolver.hosts;
+		resolver.hosts = h;
+		resolver.nhosts++;
+		pthread_cond_signal(&resolver.cond);
+	}
+
+	ret = h->state != HOST_DONE;
+	pthread_mutex_unlock(&resolver.lock);
+	return ret;
+}
+
+/* Returns the addresses of e->server:e->port, waiting for the
+ * lookup if needed, or NULL if it failed. The result belongs
+ * to the resolver, and is valid until net_resolve() is next
+ * called. */
+struct addrinfo *
+net_lookup(Elem *e) {
+	struct pollfd pfd;
+	Host *h;
+
+	while (net_resolve(e)) {
+		pfd.fd = net_resolvefd();
+		pfd.events = POLLIN;
+		poll(&pfd, 1, -1);
+	}
+
+	/* net_resolve() put it at the front if it was new,
+	 * otherwise it's still wherever it was */
+	for (h = resolver.hosts; h; h = h->next)
+		if (strcmp(h->server, e->server) == 0 && strcmp(h->port, e->port) == 0)
+			return h->ai;
+	return NULL;
+}
+
+/* Orders addresses so that families alternate,
+ * starting with whatever getaddrinfo() preferred. */
+size_t
+net_interleave(struct addrinfo *res, struct addrinfo ***ret) {
+	struct addrinfo *ai, **a, **b;
+	size_t n, na, nb, i;
+
+	for (n = 0, ai = res; ai; ai = ai->ai_next, n++);
+	a = emalloc(n * sizeof(struct addrinfo *));
+	b = emalloc(n * sizeof(struct addrinfo *));
+
+	for (na = nb = 0, ai = res; ai; ai = ai->ai_next) {
+		if (ai->ai_family == res->ai_family)
+			a[na++] = ai;
+		else
+			b[nb++] = ai;
+	}
+
+	*ret = emalloc(n * sizeof(struct addrinfo *));
+	for (i = n = 0; i < na || i < nb; i++) {
+		if (i < na)
+			(*ret)[n++] = a[i];
+		if (i < nb)
+			(*ret)[n++] = b[i];
+	}
+
+	free(a);
+	free(b);
+	return n;
+}
+
+/* Starts connecting to e->server:e->port, racing all of its
+ * addresses as in RFC 8305 (Happy Eyeballs): net_dialstep()
+ * starts a new attempt every CONNDELAY ms, or as soon as one
+ * fails, and the first to connect wins. Returns -1 if the
+ * lookup failed, which it waits for if needed. */
+int
+net_dialstart(Dial *d, Elem *e) {
+	struct addrinfo *res, **order;
+	size_t i;
+
+	memset(d, 0, sizeof(Dial));
+	if ((res = net_lookup(e)) == NULL)
+		return -1;
+
+	/* the lookup is only valid until the next net_resolve(),
+	 * and a dial may last many calls to run() */
+	d->n = net_interleave(res, &order);
+	d->addrs = emalloc(d->n * sizeof(struct addrinfo));
+	for (i = 0; i < d->n; i++) {
+		d->addrs[i] = *order[i];
+		d->addrs[i].ai_addr = emalloc(order[i]->ai_addrlen);
+		memcpy(d->addrs[i].ai_addr, order[i]->ai_addr, order[i]->ai_addrlen);
+		d->addrs[i].ai_canonname = NULL;
+		d->addrs[i].ai_next = NULL;
+	}
+	free(order);
+
+	d->pfds = emalloc(d->n * sizeof(struct pollfd));
+	d->deadline = net_ms() + CONNTIMEOUT;
+	return 0;
+}
+
+/* Checks on the attempts without blocking, and starts the
+ * next if it's time. Returns the connected non-blocking
+ * socket, -1 if every attempt failed, or NET_AGAIN. */
+int
+net_dialstep(Dial *d) {
+	struct addrinfo *ai;
+	socklen_t len;
+	size_t i;
+	long now;
+	int s, err;
+
+	if (d->pending && poll(d->pfds, d->started, 0) > 0) {
+		for (i = 0; i < d->started; i++) {
+			if (d->pfds[i].fd == -1 || !d->pfds[i].revents)
+				continue;
+			s = d->pfds[i].fd;
+			d->pfds[i].fd = -1;
+			d->pending--;
+			len = sizeof(err);
+			if (getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+				return s;
+			close(s);
+			d->next = 0; /* try the next one now */
+		}
+	}
+
+	now = net_ms();
+	if (now >= d->deadline)
+		return -1;
+
+	while (d->started < d->n && (!d->pending || now >= d->next)) {
+		ai = &d->addrs[d->started];
+		d->pfds[d->started].fd = -1;
+		d->pfds[d->started].events = POLLOUT;
+		d->started++;
+		d->next = now + CONNDELAY;
+		if ((s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+			continue;
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+		if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+			return s;
+		if (errno == EINPROGRESS) {
+			d->pfds[d->started - 1].fd = s;
+			d->pending++;
+		} else {
+			close(s);
+		}
+	}
+
+	return d->pending ? NET_AGAIN : -1;
+}
+
+/* ms until net_dialstep() has something to do,
+ * if none of d->pfds become writable first */
+int
+net_dialwait(Dial *d) {
+	long wait;
+
+	wait = (d->started < d->n ? d->next : d->deadline) - net_ms();
+	return wait > 0 ? wait : 0;
+}
+
+/* Gives up on the attempts still going */
+void
+net_dialend(Dial *d) {
+	size_t i;
+
+	for (i = 0; i < d->started; i++)
+		if (d->pfds[i].fd != -1)
+			close(d->pfds[i].fd);
+	for (i = 0; i < d->n; i++)
+		free(d->addrs[i].ai_addr);
+	free(d->pfds);
+	free(d->addrs);
+	memset(d, 0, sizeof(Dial));
+}
+
+/* Connects to e->server:e->port with the above.
+ * Returns a blocking socket, or -1. */
+int
+net_dial(Elem *e, int silent) {
+	Dial d;
+	int fd;
+
+	if (net_dialstart(&d, e) == -1) {
+		if (!silent)
+			error("could not lookup %s:%s", e->server, e->port);
+		return -1;
+	}
+
+	while ((fd = net_dialstep(&d)) == NET_AGAIN)
+		poll(d.pfds, d.started, net_dialwait(&d));
+	net_dialend(&d);
+
+	if (fd == -1) {
+		if (!silent)
+			error("could not connect to %s:%s", e->server, e->port);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	return fd;
+}
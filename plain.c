@@ -17,48 +17,65 @@
  *
  */
 
+#include <errno.h>
+#include <poll.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include <netdb.h>
-#include <sys/socket.h>
 #include "zygo.h"
 
-static int fd;
-static struct addrinfo *ai = NULL;
-
-int
+Conn *
 net_connect(Elem *e, int silent) {
-	int ret;
+	int fd;
 
-	if (ai)
-		freeaddrinfo(ai);
+	if ((fd = net_dial(e, silent)) == -1)
+		return NULL;
+	return net_start(e, fd, silent);
+}
 
-	if ((ret = getaddrinfo(e->server, e->port, NULL, &ai)) != 0 || ai == NULL) {
-		if (!silent)
-			error("could not lookup %s:%s", e->server, e->port);
-		return -1;
-	}
+/* Makes a connection of fd, from net_dialstep() */
+Conn *
+net_start(Elem *e, int fd, int silent) {
+	Conn *c;
 
-	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1 ||
-			connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
-		if (!silent)
-			error("could not connect to %s:%s", e->server, e->port);
-		return -1;
-	}
+	(void)e;
+	(void)silent;
+	c = emalloc(sizeof(Conn));
+	memset(c, 0, sizeof(Conn));
+	c->fd = fd;
+	return c;
+}
 
+/* Only TLS connections have a handshake */
+int
+net_handshake(Conn *c, int silent) {
+	(void)c;
+	(void)silent;
 	return 0;
 }
 
 int
-net_read(void *buf, size_t count) {
-	return read(fd, buf, count);
+net_read(Conn *c, void *buf, size_t count) {
+	int ret;
+
+	if ((ret = read(c->fd, buf, count)) == -1 &&
+			(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return NET_AGAIN;
+	return ret;
 }
 
 int
-net_write(void *buf, size_t count) {
-	return write(fd, buf, count);
+net_write(Conn *c, void *buf, size_t count) {
+	return write(c->fd, buf, count);
 }
 
 int
-net_close(void) {
-	return close(fd);
+net_close(Conn *c) {
+	int ret;
+
+	ret = close(c->fd);
+	free(c);
+	return ret;
 }
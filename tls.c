@@ -17,127 +17,238 @@
  *
  */
 
+#include <errno.h>
+#include <poll.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include <netdb.h>
 #include <tls.h>
-#include <sys/socket.h>
 #include "zygo.h"
 
-struct tls *ctx = NULL;
-struct tls_config *conf = NULL;
-int fd;
-int tls;
+struct tls_config *conf = NULL; /* shared by every connection */
+Tlsstats tlsstats = {0, 0};
 
+/* Sessions for resumption, most recently used first */
+struct {
+	Session *head;
+	size_t len;
+} sessions = {NULL, 0};
+
+/* Returns the file holding the session for e->server:e->port,
+ * creating it if needed, or -1. libtls reads it when
+ * connecting and writes it after a handshake. */
 int
-net_connect(Elem *e, int silent) {
-	struct addrinfo *ai = NULL;
-	int ret;
+net_session(Elem *e) {
+	Session *s, *prev;
+	char path[] = "/tmp/zygo.XXXXXX";
+	int sfd;
 
-	tls = e->tls;
+	for (prev = NULL, s = sessions.head; s; prev = s, s = s->next) {
+		if (strcmp(s->server, e->server) == 0 && strcmp(s->port, e->port) == 0) {
+			if (prev) {
+				prev->next = s->next;
+				s->next = sessions.head;
+				sessions.head = s;
+			}
+			return s->fd;
+		}
+	}
 
-	if (tls) {
-		if (conf)
-			tls_config_free(conf);
-		if (ctx)
-			tls_free(ctx);
+	/* mkstemp() makes it mode 0600, which libtls insists on */
+	if ((sfd = mkstemp(path)) == -1)
+		return -1;
+	unlink(path);
 
-		if ((conf = tls_config_new()) == NULL) {
-			if (!silent)
-				error("tls_config_new(): %s", tls_config_error(conf));
-			goto fail;
-		}
+	if (sessions.len >= TLSSESSIONS) {
+		for (prev = NULL, s = sessions.head; s->next; prev = s, s = s->next);
+		prev->next = NULL;
+		close(s->fd);
+		free(s->server);
+		free(s->port);
+		free(s);
+		sessions.len--;
+	}
 
-		if (insecure) {
-			tls_config_insecure_noverifycert(conf);
-			tls_config_insecure_noverifyname(conf);
-		}
+	s = emalloc(sizeof(Session));
+	s->server = estrdup(e->server);
+	s->port = estrdup(e->port);
+	s->fd = sfd;
+	s->next = sessions.head;
+	sessions.head = s;
+	sessions.len++;
+	return sfd;
+}
 
+/* Returns a new config, or NULL */
+struct tls_config *
+net_config(int silent) {
+	struct tls_config *cfg;
+
+	if ((cfg = tls_config_new()) == NULL) {
+		if (!silent)
+			error("tls_config_new(): %s", strerror(errno));
+		return NULL;
+	}
+
+	if (insecure) {
+		tls_config_insecure_noverifycert(cfg);
+		tls_config_insecure_noverifyname(cfg);
+	}
+	return cfg;
+}
+
+/* Makes a connection of fd, configured with cfg if e->tls.
+ * The TLS handshake is left to net_handshake(). */
+Conn *
+net_starttls(Elem *e, int fd, struct tls_config *cfg, int silent) {
+	struct tls *ctx = NULL;
+	Conn *c;
+
+	if (e->tls) {
 		if ((ctx = tls_client()) == NULL) {
 			if (!silent)
-				error("tls_client(): %s", tls_error(ctx));
+				error("tls_client(): %s", strerror(errno));
 			goto fail;
 		}
 
-		if (tls_configure(ctx, conf) == -1) {
+		if (tls_configure(ctx, cfg) == -1) {
 			if (!silent)
 				error("tls_configure(): %s", tls_error(ctx));
 			goto fail;
 		}
-	}
-
-	if ((ret = getaddrinfo(e->server, e->port, NULL, &ai)) != 0 || ai == NULL) {
-		if (!silent)
-			error("could not lookup %s:%s", e->server, e->port);
-		goto fail;
-	}
 
-	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1 ||
-			connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
-		if (!silent)
-			error("could not connect to %s:%s", e->server, e->port);
-		goto fail;
-	}
-
-	if (tls) {
 		if (tls_connect_socket(ctx, fd, e->server) == -1) {
 			if (!silent)
 				error("could not tls-ify connection to %s:%s", e->server, e->port);
 			goto fail;
 		}
-
-		if (tls_handshake(ctx) == -1) {
-			if (!silent)
-				error("could not perform tls handshake with %s:%s", e->server, e->port);
-			goto fail;
-		}
 	}
 
-	freeaddrinfo(ai);
-	return 0;
+	c = emalloc(sizeof(Conn));
+	memset(c, 0, sizeof(Conn));
+	c->fd = fd;
+	c->tls = e->tls;
+	c->ctx = ctx;
+	c->started = net_ms();
+	return c;
 
 fail:
-	if (ai)
-		freeaddrinfo(ai);
-	if (ctx) {
+	close(fd);
+	if (ctx)
 		tls_free(ctx);
-		ctx = NULL;
+	return NULL;
+}
+
+Conn *
+net_connect(Elem *e, int silent) {
+	Conn *c;
+	int fd;
+
+	if (e->tls && !conf && (conf = net_config(silent)) == NULL)
+		return NULL;
+	if ((fd = net_dial(e, silent)) == -1)
+		return NULL;
+
+	/* libtls reads the session in tls_connect_socket() and
+	 * writes it in tls_handshake(), both done below before
+	 * any other connection can change the shared config */
+	if (e->tls)
+		tls_config_set_session_fd(conf, net_session(e));
+	if ((c = net_starttls(e, fd, conf, silent)) == NULL)
+		return NULL;
+
+	/* fd is blocking, so this returns 0 or -1 */
+	if (net_handshake(c, 1) != 0) {
+		if (!silent)
+			error("could not perform tls handshake with %s:%s", e->server, e->port);
+		net_close(c);
+		return NULL;
+	}
+	return c;
+}
+
+/* Like net_connect(), for fd from net_dialstep(),
+ * which is left non-blocking. */
+Conn *
+net_start(Elem *e, int fd, int silent) {
+	struct tls_config *cfg = NULL;
+	Conn *c;
+
+	/* A config of its own, as the handshake may not be
+	 * over before another connection changes the shared
+	 * config's session (see net_connect()). */
+	if (e->tls) {
+		if ((cfg = net_config(silent)) == NULL) {
+			close(fd);
+			return NULL;
+		}
+		tls_config_set_session_fd(cfg, net_session(e));
 	}
-	if (conf) {
-		tls_config_free(conf);
-		conf = NULL;
+
+	c = net_starttls(e, fd, cfg, silent);
+	if (cfg)
+		tls_config_free(cfg); /* the connection holds a reference */
+	return c;
+}
+
+/* Does some of the handshake. Returns 0 once it's done,
+ * -1 if it failed, or the poll() events to wait for. */
+int
+net_handshake(Conn *c, int silent) {
+	if (!c->tls)
+		return 0;
+
+	switch (tls_handshake(c->ctx)) {
+	case TLS_WANT_POLLIN:
+		return POLLIN;
+	case TLS_WANT_POLLOUT:
+		return POLLOUT;
+	case -1:
+		if (!silent)
+			error("tls_handshake(): %s", tls_error(c->ctx));
+		return -1;
 	}
-	return -1;
+
+	c->handshake = net_ms() - c->started;
+	c->resumed = tls_conn_session_resumed(c->ctx);
+	tlsstats.handshakes++;
+	if (c->resumed)
+		tlsstats.resumed++;
+	return 0;
 }
 
 int
-net_read(void *buf, size_t count) {
+net_read(Conn *c, void *buf, size_t count) {
 	int ret;
 
-	if (tls) {
-		do {
-			ret = tls_read(ctx, buf, count);
-		} while (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT);
+	if (c->tls) {
+		ret = tls_read(c->ctx, buf, count);
+		if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT)
+			return NET_AGAIN;
 		if (ret == -1)
-			error("tls_read(): %s", tls_error(ctx));
-	} else {
-		ret = read(fd, buf, count);
+			error("tls_read(): %s", tls_error(c->ctx));
+	} else if ((ret = read(c->fd, buf, count)) == -1 &&
+			(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return NET_AGAIN;
 	}
 
 	return ret;
 }
 
 int
-net_write(void *buf, size_t count) {
-	int ret;
+net_write(Conn *c, void *buf, size_t count) {
+	int ret = 0;
 
-	if (tls) {
+	if (c->tls) {
 		while (count > 0) {
-			switch (ret = tls_write(ctx, buf, count)) {
+			switch (ret = tls_write(c->ctx, buf, count)) {
 			case TLS_WANT_POLLIN:
 			case TLS_WANT_POLLOUT:
 				break;
 			case -1:
-				error("tls_write(): %s", tls_error(ctx));
+				error("tls_write(): %s", tls_error(c->ctx));
 				break;
 			default:
 				buf += ret;
@@ -145,25 +256,26 @@ net_write(void *buf, size_t count) {
 			}
 		}
 	} else {
-		ret = write(fd, buf, count);
+		ret = write(c->fd, buf, count);
 	}
 
 	return ret;
 }
 
 int
-net_close(void) {
+net_close(Conn *c) {
 	int ret;
 
-	if (tls) {
+	if (c->tls) {
+		/* don't wait for the server's close_notify, the
+		 * connection may be non-blocking (see go()) */
 		do {
-			ret = tls_close(ctx);
-		} while (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT);
-		tls_free(ctx);
-		ctx = NULL;
-		tls_config_free(conf);
-		conf = NULL;
+			ret = tls_close(c->ctx);
+		} while (ret == TLS_WANT_POLLOUT);
+		tls_free(c->ctx);
 	}
 
-	return close(fd);
+	ret = close(c->fd);
+	free(c);
+	return ret;
 }
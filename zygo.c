@@ -18,6 +18,8 @@
  */
 
 #define _XOPEN_SOURCE_EXTENDED /* ncurses wchar wants this sometimes */
+#define _XOPEN_SOURCE 700 /* wcwidth() */
+#define _DEFAULT_SOURCE /* which would hide the rest on glibc */
 #include <ncurses.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,15 +33,120 @@
 #include <regex.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <errno.h>
 #include <wchar.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "zygo.h"
 #include "config.h"
 
-Elem *history = NULL;
-Elem *page = NULL;
+List history = {NULL, 0, 0, NULL, 0, NULL, 0, NULL};
+List page = {NULL, 0, 0, NULL, 0, NULL, 0, NULL};
 Elem *current = NULL;
 int insecure = 0;
+int headless = 0; /* dumping a page with -d, no ncurses */
+
+/* Pages not currently shown, most recently used first */
+struct {
+	Cache *head;
+	Cache *tail;
+	size_t size;
+} cache = {NULL, NULL, 0};
+
+char *cachedir = NULL; /* disk cache, set if enabled */
+size_t disksize = 0; /* bytes in cachedir, counted by disk_trim() */
+char *tlscapfile = NULL; /* where tlscaps are saved, if anywhere */
+
+/* scheme[] entry of each type, see scheme_init() */
+Scheme *schemes[256];
+
+/* Threads checking a search, see search_threaded() */
+struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	Chunk *chunks;
+	size_t nchunks;
+	size_t next; /* chunk to be taken */
+	int busy;
+} par = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0};
+
+/* Lines as drawn, by row, see render_get() */
+struct {
+	Render *rows;
+	int len;
+} render = {NULL, 0};
+
+/* Whether hosts support TLS, most recently used first */
+struct {
+	Tlscap *head;
+	size_t len;
+} tlscaps = {NULL, 0};
+
+/* Response being read into page by run() */
+struct {
+	int active;
+	int gotall;
+	int tls; /* page came over a new TLS connection */
+	long handshake; /* ...and its Conn's handshake stats */
+	int resumed;
+	Conn *conn;
+} fetch = {0, 0, 0, 0, 0, NULL};
+
+/* Links being fetched into the cache in the background */
+struct {
+	Prefetch jobs[PREFETCHJOBS];
+	size_t active;
+	char *from; /* uri of the page links are taken from */
+	size_t used; /* bytes fetched for from */
+	size_t *tried; /* ids from that have been fetched */
+	size_t ntried;
+	int resolving; /* waiting for a lookup to start the next */
+} pre;
+
+/* Links followed, most recently used first */
+struct {
+	Follow *head;
+	size_t len;
+} follows = {NULL, 0};
+
+/* Words on pages visited, see index_page() */
+struct {
+	Word **buckets;
+	size_t nbuckets;
+	size_t nwords;
+	Indexed *pages;
+	size_t npages;
+	unsigned int base; /* id of pages[0] */
+	size_t size; /* bytes used */
+} fulltext = {NULL, 0, 0, NULL, 0, 0, 0};
+
+/* Item being downloaded for the plumber */
+struct {
+	Conn *conn;
+	int fd;
+	char *path;
+	size_t size;
+	struct {
+		pid_t pid;
+		char *path;
+	} *plumbed; /* removed once the plumber exits, see plumb_reap() */
+	size_t nplumbed;
+} dl = {NULL, -1, NULL, 0, NULL, 0};
+
+volatile sig_atomic_t childexited = 0; /* set by sighandler() */
+
+/* Response being written to the disk cache */
+struct {
+	FILE *fp;
+	char *path; /* written to path.tmp until complete */
+	size_t size;
+} spool = {NULL, NULL, 0};
 
 #define TLSOPTS "ku"
 
@@ -52,7 +159,10 @@ struct {
 	char cmd;
 	char arg[BUFLEN * 4]; /* UTF8 max char size: 4 bytes. 4x sizeof(input) */
 	int search;
-	regex_t regex;
+	Matcher matcher;
+	char *pattern; /* what matcher was compiled from */
+	Matches matches;
+	int findpending; /* 1 + backward, until find() is done */
 	int error;
 	char errorbuf[BUFLEN];
 } ui = {.scroll = 0,
@@ -99,6 +209,60 @@ estrdup(const char *str) {
 	return ret;
 }
 
+/*
+ * Arena functions
+ */
+void *
+arena_alloc(Arena **a, size_t size) {
+	Arena *block;
+	void *ret;
+
+	size = (size + ARENAALIGN - 1) & ~(size_t)(ARENAALIGN - 1);
+	if (!*a || (*a)->size - (*a)->used < size) {
+		block = emalloc(sizeof(Arena));
+		block->size = size > ARENALEN ? size : ARENALEN;
+		block->mem = emalloc(block->size);
+		block->used = 0;
+		block->next = *a;
+		*a = block;
+	}
+
+	ret = (*a)->mem + (*a)->used;
+	(*a)->used += size;
+	return ret;
+}
+
+/* Gives back size bytes at ptr, if they were the last
+ * allocated from *a. Emptied blocks are freed. */
+void
+arena_unalloc(Arena **a, void *ptr, size_t size) {
+	Arena *block = *a;
+
+	size = (size + ARENAALIGN - 1) & ~(size_t)(ARENAALIGN - 1);
+	if (!block || (char *)ptr < block->mem ||
+			(char *)ptr + size != block->mem + block->used)
+		return;
+
+	block->used -= size;
+	if (!block->used) {
+		*a = block->next;
+		free(block->mem);
+		free(block);
+	}
+}
+
+void
+arena_free(Arena **a) {
+	Arena *p, *next;
+
+	for (p = *a; p; p = next) {
+		next = p->next;
+		free(p->mem);
+		free(p);
+	}
+	*a = NULL;
+}
+
 /*
  * Elem functions
  */
@@ -123,8 +287,8 @@ elem_create(int tls, char type, char *desc, char *selector, char *server, char *
 	ret->selector = DUP(selector);
 	ret->server = DUP(server);
 	ret->port = DUP(port);
-	ret->id = ret->len = ret->lastid = 0;
-	ret->next = NULL;
+	ret->id = 0;
+	ret->scheme = NULL;
 #undef DUP
 	return ret;
 }
@@ -134,6 +298,40 @@ elem_dup(Elem *e) {
 	return (e ? elem_create(e->tls, e->type, e->desc, e->selector, e->server, e->port) : NULL);
 }
 
+#define LEN(str) (str ? strlen(str) + 1 : 0)
+/* Size of the allocation made by elem_arenadup() */
+size_t
+elem_arenasize(Elem *e) {
+	return LEN(e->desc) + LEN(e->selector) + LEN(e->server) + LEN(e->port);
+}
+
+/* Like elem_dup(), but copies into ret, with the
+ * strings put in one allocation from an arena. */
+Elem *
+elem_arenadup(Arena **a, Elem *ret, Elem *e) {
+	char *p;
+	size_t size;
+
+	size = elem_arenasize(e);
+	p = size ? arena_alloc(a, size) : NULL;
+#define DUP(field) \
+	if (e->field) { \
+		ret->field = memcpy(p, e->field, LEN(e->field)); \
+		p += LEN(e->field); \
+	} else ret->field = NULL
+	DUP(desc);
+	DUP(selector);
+	DUP(server);
+	DUP(port);
+#undef DUP
+#undef LEN
+	ret->tls = e->tls;
+	ret->type = e->type;
+	ret->id = 0;
+	ret->scheme = NULL;
+	return ret;
+}
+
 char *
 elemtouri(Elem *e) {
 	static char ret[BUFLEN];
@@ -256,24 +454,32 @@ end:
 	return ret;
 }
 
+/* Parses line into ret. No memory is allocated:
+ * line is modified, and ret points into it. */
 Elem *
-gophertoelem(Elem *from, const char *line) {
-	Elem *ret;
-	char *dup = estrdup(line);
-	char *tmp = dup;
+gophertoelem(Elem *ret, Elem *from, char *line) {
+	char *tmp = line;
 	char *p;
 	enum {SEGDESC, SEGSELECTOR, SEGSERVER, SEGPORT} seg;
 
-	ret = elem_create(0, *(tmp++), NULL, NULL, NULL, NULL);
+	ret->desc = ret->selector = ret->server = ret->port = NULL;
+	ret->id = 0;
+	ret->scheme = NULL;
+	ret->tls = 0;
+
+	/* a blank line has no type: don't step past its end */
+	if (!*line)
+		goto invalid;
+	ret->type = *(tmp++);
 
 	for (p = tmp, seg = SEGDESC; *p; p++) {
 		if (*p == '\t') {
 			*p = '\0';
 			switch (seg) {
-			case SEGDESC:     ret->desc     = estrdup(tmp); break;
-			case SEGSELECTOR: ret->selector = estrdup(tmp); break;
-			case SEGSERVER:   ret->server   = estrdup(tmp); break;
-			case SEGPORT:     ret->port     = estrdup(tmp); break;
+			case SEGDESC:     ret->desc     = tmp; break;
+			case SEGSELECTOR: ret->selector = tmp; break;
+			case SEGSERVER:   ret->server   = tmp; break;
+			case SEGPORT:     ret->port     = tmp; break;
 			}
 			tmp = p + 1;
 			seg++;
@@ -283,7 +489,7 @@ gophertoelem(Elem *from, const char *line) {
 	/* ret->port will only be set on gopher+ menus with 
 	 * the above loop, set it here for non-gopher+ */
 	if (!ret->port)
-		ret->port = estrdup(tmp);
+		ret->port = tmp;
 	if (from && from->tls && ret->server && ret->port &&
 			strcmp(ret->server, from->server) == 0 &&
 			strcmp(ret->port, from->port) == 0)
@@ -291,22 +497,15 @@ gophertoelem(Elem *from, const char *line) {
 	else
 		ret->tls = 0;
 
-	free(dup);
-
 	if (ret->desc != NULL &&
 			ret->server != NULL &&
 			ret->port != NULL)
 		return ret;
 
-	free(ret->desc);
-	free(ret->selector);
-	free(ret->server);
-	free(ret->port);
+invalid:
 	ret->type = '3';
-	ret->desc = estrdup("invalid gopher menu element");
-	ret->selector = estrdup("Err");
-	ret->server = estrdup("Err");
-	ret->port = estrdup("Err");
+	ret->desc = "invalid gopher menu element";
+	ret->selector = ret->server = ret->port = "Err";
 	return ret;
 }
 
@@ -314,146 +513,1508 @@ gophertoelem(Elem *from, const char *line) {
  * List functions
  */
 void
-list_free(Elem **l) {
-	Elem *prev, *p;
+list_free(List *l) {
+	if (!l)
+		return;
+	arena_free(&l->arena);
+	free(l->elems);
+	free(l->ids);
+	free(l->lines);
+	l->elems = NULL;
+	l->ids = NULL;
+	l->lines = NULL;
+	l->len = l->size = l->lastid = 0;
+	l->partial = 0;
+}
+
+void
+list_append(List *l, Elem *e) {
+	Elem elem;
+
+	zygo_assert(l);
+	list_push(l, elem_arenadup(&l->arena, &elem, e));
+}
+
+/* Like list_append(), but e's strings are not copied:
+ * they must already be owned by the list's arena. */
+void
+list_push(List *l, Elem *e) {
+	Elem *elem;
+
+	zygo_assert(l && !l->lines);
+	if (l->len == l->size) {
+		l->size = l->size ? l->size * 2 : 64;
+		l->elems = erealloc(l->elems, l->size * sizeof(Elem));
+		l->ids = erealloc(l->ids, l->size * sizeof(size_t));
+	}
+
+	elem = &l->elems[l->len];
+	*elem = *e;
+	elem->id = 0;
+	elem->scheme = getscheme(elem);
+	if (elem->type != 'i' && elem->type != '3') {
+		elem->id = ++l->lastid;
+		l->ids[elem->id - 1] = l->len;
+	}
+	l->len++;
+}
+
+/* Adds a line of a text document, which is only kept as
+ * a pointer, as all of its lines are 'i' elements. The line
+ * must already be owned by the list's arena. */
+void
+list_pushline(List *l, char *line) {
+	zygo_assert(l && (l->lines || !l->len));
+	if (l->len == l->size) {
+		l->size = l->size ? l->size * 2 : 64;
+		l->lines = erealloc(l->lines, l->size * sizeof(char *));
+	}
+	l->lines[l->len++] = line;
+}
+
+/* Removes the last element. Its strings are freed if
+ * nothing was allocated from the list's arena since
+ * (as for history), or else with the rest of the list. */
+void
+list_pop(List *l) {
+	Elem *e;
+	char *first;
+
+	if (!l || !l->len)
+		return;
+	if (l->lines) {
+		l->len--;
+		return;
+	}
+
+	e = &l->elems[--l->len];
+	if (e->id)
+		l->lastid--;
+	/* elem_arenadup() copies desc first, port last */
+	first = e->desc ? e->desc : e->selector ? e->selector :
+		e->server ? e->server : e->port;
+	if (first)
+		arena_unalloc(&l->arena, first, elem_arenasize(e));
+}
+
+/* The element for a line of a text document is made up
+ * on the spot, and is only valid until the next call. */
+Elem *
+list_get(List *l, size_t elem) {
+	static Elem line = INFO(NULL);
+
+	if (!l || elem >= l->len)
+		return NULL;
+	if (l->lines) {
+		line.desc = l->lines[elem];
+		line.scheme = getscheme(&line);
+		return &line;
+	}
+	return &l->elems[elem];
+}
+
+/* Like list_get()->desc, but doesn't make up an element,
+ * so it can be used from search_worker() */
+char *
+list_desc(List *l, size_t elem) {
+	if (!l || elem >= l->len)
+		return NULL;
+	return l->lines ? l->lines[elem] : l->elems[elem].desc;
+}
+
+Elem *
+list_idget(List *l, size_t id) {
+	if (!l || id < 1 || id > l->lastid)
+		return NULL;
+	return &l->elems[l->ids[id - 1]];
+}
+
+size_t
+list_len(List *l) {
+	if (!l)
+		return 0;
+	return l->len;
+}
+
+void
+list_rev(List *l) {
+	Elem tmp;
+	size_t i, j;
+
+	if (!l || !l->len)
+		return;
+	zygo_assert(!l->lines);
+
+	for (i = 0, j = l->len - 1; i < j; i++, j--) {
+		tmp = l->elems[i];
+		l->elems[i] = l->elems[j];
+		l->elems[j] = tmp;
+	}
+
+	for (i = 0; i < l->len; i++) {
+		if (l->elems[i].id) {
+			l->elems[i].id = l->lastid - l->elems[i].id + 1;
+			l->ids[l->elems[i].id - 1] = i;
+		}
+	}
+}
+
+size_t
+list_size(List *l) {
+	Arena *a;
+	size_t ret;
+
+	if (l->lines)
+		ret = l->size * sizeof(char *);
+	else
+		ret = l->size * (sizeof(Elem) + sizeof(size_t));
+	for (a = l->arena; a; a = a->next)
+		ret += sizeof(Arena) + a->size;
+	return ret;
+}
+
+/*
+ * Cache functions
+ */
+void
+cache_unlink(Cache *c) {
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		cache.head = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	else
+		cache.tail = c->prev;
+	cache.size -= c->size;
+}
+
+void
+cache_free(Cache *c) {
+	list_free(&c->page);
+	free(c->uri);
+	free(c);
+}
+
+/* Takes l (which is left empty) and keeps it as the page
+ * for e, or frees it if it can't be kept. Least recently
+ * used pages are dropped until the cache fits in cachemax. */
+void
+cache_put(Elem *e, List *l, int scroll) {
+	Cache *c;
+
+	if (!e || !e->server || !e->port || !cachemax || l->partial) {
+		list_free(l);
+		return;
+	}
+
+	if ((c = cache_get(e)))
+		cache_free(c);
+
+	c = emalloc(sizeof(Cache));
+	c->uri = estrdup(elemtouri(e));
+	c->page = *l;
+	c->scroll = scroll;
+	c->size = list_size(l);
+	c->prev = NULL;
+	c->next = cache.head;
+	if (cache.head)
+		cache.head->prev = c;
+	else
+		cache.tail = c;
+	cache.head = c;
+	cache.size += c->size;
+	memset(l, 0, sizeof(List));
+
+	while (cache.size > cachemax && (c = cache.tail)) {
+		cache_unlink(c);
+		cache_free(c);
+	}
+}
+
+/* Returns the page for e, if it is cached, leaving it there */
+Cache *
+cache_find(Elem *e) {
+	Cache *c;
+	char *uri;
+
+	if (!e->server || !e->port)
+		return NULL;
+
+	uri = elemtouri(e);
+	for (c = cache.head; c; c = c->next)
+		if (strcmp(c->uri, uri) == 0)
+			return c;
+
+	return NULL;
+}
+
+/* Removes and returns the page for e, if it is cached.
+ * The caller owns the result (see cache_free()). */
+Cache *
+cache_get(Elem *e) {
+	Cache *c;
+
+	if ((c = cache_find(e)))
+		cache_unlink(c);
+	return c;
+}
+
+/* Gets rid of page before it is replaced by the one for e */
+void
+cache_leave(Elem *e) {
+	char *uri = estrdup(elemtouri(e));
+
+	if (current && strcmp(elemtouri(current), uri) == 0)
+		list_free(&page); /* reloading, old copy is useless */
+	else
+		cache_put(current, &page, ui.scroll);
+	render_flush();
+	free(uri);
+}
+
+/*
+ * Disk cache functions
+ *
+ * Each response is stored in its own file, named by a hash
+ * of its uri, with a one line header:
+ *   zygo <fetch time> <size> <uri>
+ */
+#define DISKHDR "zygo %020lld %020zu %s\n"
+#define DISKSIZEOFF 26 /* offset of size in DISKHDR */
+
+/* Returns $XDG_CACHE_HOME/zygo (or ~/.cache/zygo), which
+ * is made if needed, or NULL. The caller frees the result. */
+char *
+dir_init(void) {
+	char *base, *p, *dir;
+	size_t len;
+
+	if ((base = getenv("XDG_CACHE_HOME")) && *base) {
+		len = strlen(base) + strlen("/zygo") + 1;
+		dir = emalloc(len);
+		snprintf(dir, len, "%s/zygo", base);
+	} else if ((base = getenv("HOME"))) {
+		len = strlen(base) + strlen("/.cache/zygo") + 1;
+		dir = emalloc(len);
+		snprintf(dir, len, "%s/.cache/zygo", base);
+	} else {
+		return NULL;
+	}
+
+	/* mkdir -p */
+	for (p = dir + 1; ; p++) {
+		if (*p == '/' || *p == '\0') {
+			base = p;
+			*p = '\0';
+			if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+				free(dir);
+				return NULL;
+			}
+			if (p == dir + len - 1)
+				break;
+			*base = '/';
+		}
+	}
+	return dir;
+}
+
+void
+disk_init(void) {
+	if ((cachedir = dir_init()))
+		disk_trim();
+}
+
+/* Returns how long a page of this type may be used from
+ * the disk cache without refetching, or -1 if it isn't
+ * stored at all. */
+long
+disk_ttl(char type) {
+	size_t i;
+
+	for (i = 0; i < sizeof(expiry) / sizeof(expiry[0]); i++)
+		if (expiry[i].type == type)
+			return expiry[i].ttl;
+	return -1;
+}
+
+/* Path of the file for e. Static buffer. */
+char *
+disk_path(Elem *e) {
+	static char ret[PATH_MAX];
+	unsigned long long hash = 14695981039346656037ULL; /* FNV-1a */
+	char *p;
+
+	for (p = elemtouri(e); *p; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 1099511628211ULL;
+	}
+
+	snprintf(ret, sizeof(ret), "%s/%016llx", cachedir, hash);
+	return ret;
+}
+
+int
+disk_get(Elem *e, Disk *d) {
+	struct stat st;
+	long long fetched;
+	size_t size, ulen, hlen;
+	char *path, *uri, *nl, hdr[64];
+	int fd, n;
+
+	memset(d, 0, sizeof(Disk));
+	if (!cachedir || disk_ttl(e->type) == -1)
+		return -1;
+
+	path = disk_path(e);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &st) == -1 || st.st_size == 0 ||
+			(d->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		d->map = NULL;
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	d->maplen = st.st_size;
+
+	/* the map isn't NUL terminated: sscanf() a copy of
+	 * the start of the header, which is all it needs */
+	if ((nl = memchr(d->map, '\n', d->maplen)) == NULL) {
+		disk_unmap(d);
+		return -1;
+	}
+	hlen = nl - (char *)d->map;
+	hlen = hlen < sizeof(hdr) ? hlen : sizeof(hdr) - 1;
+	memcpy(hdr, d->map, hlen);
+	hdr[hlen] = '\0';
+
+	uri = elemtouri(e);
+	ulen = strlen(uri);
+	if (sscanf(hdr, "zygo %lld %zu %n", &fetched, &size, &n) != 2 ||
+			(size_t)(nl - ((char *)d->map + n)) != ulen ||
+			memcmp((char *)d->map + n, uri, ulen) != 0 ||
+			d->maplen - (nl + 1 - (char *)d->map) != size) {
+		disk_unmap(d);
+		return -1;
+	}
+
+	d->body = nl + 1;
+	d->len = size;
+	d->fetched = fetched;
+	utimensat(AT_FDCWD, path, NULL, 0); /* for disk_trim() */
+	return 0;
+}
+
+void
+disk_unmap(Disk *d) {
+	if (d->map)
+		munmap(d->map, d->maplen);
+	memset(d, 0, sizeof(Disk));
+}
+
+/* Starts copying the response for e to the disk cache,
+ * if it should be stored. See readline(). */
+void
+disk_start(Elem *e) {
+	char tmp[PATH_MAX];
+
+	if (!cachedir || disk_ttl(e->type) <= 0)
+		return;
+
+	spool.path = estrdup(disk_path(e));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", spool.path);
+	if ((spool.fp = fopen(tmp, "w")) == NULL) {
+		free(spool.path);
+		spool.path = NULL;
+		return;
+	}
+
+	spool.size = 0;
+	fprintf(spool.fp, DISKHDR, (long long)time(NULL), spool.size, elemtouri(e));
+}
+
+/* Moves the response into place, or throws it away */
+void
+disk_finish(int keep) {
+	struct stat st;
+	char tmp[PATH_MAX];
+	long len;
+
+	if (!spool.fp)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", spool.path);
+	len = ftell(spool.fp);
+	/* the header is fixed width, so the size can be filled in */
+	if (keep && fseek(spool.fp, DISKSIZEOFF, SEEK_SET) != -1)
+		fprintf(spool.fp, "%020zu", spool.size);
+	if (fclose(spool.fp) == 0 && keep && len != -1) {
+		/* the total is only a guess between calls to disk_trim(),
+		 * it isn't told about other instances using the cache */
+		if (stat(spool.path, &st) == 0)
+			disksize -= (size_t)st.st_size < disksize ? (size_t)st.st_size : disksize;
+		if (rename(tmp, spool.path) == 0)
+			disksize += len;
+		else
+			unlink(tmp);
+	} else {
+		unlink(tmp);
+	}
+
+	free(spool.path);
+	spool.fp = NULL;
+	spool.path = NULL;
+	if (diskcachemax && disksize > diskcachemax)
+		disk_trim();
+}
+
+int
+disk_filecmp(const void *a, const void *b) {
+	const Diskfile *fa = a, *fb = b;
+
+	if (fa->mtime.tv_sec != fb->mtime.tv_sec)
+		return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+	if (fa->mtime.tv_nsec != fb->mtime.tv_nsec)
+		return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* Deletes least recently used files until the cache is
+ * well under diskcachemax, so that it isn't scanned again
+ * for a while, and sets disksize. */
+void
+disk_trim(void) {
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	Diskfile *files = NULL;
+	char path[PATH_MAX];
+	size_t nfiles = 0, total = 0, i;
+	int over;
+
+	if (!diskcachemax || (dir = opendir(cachedir)) == NULL)
+		return;
+
+	while ((de = readdir(dir))) {
+		/* not a page (see tlscap_save()) */
+		if (strncmp(de->d_name, TLSCAPFILE, strlen(TLSCAPFILE)) == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cachedir, de->d_name);
+		if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+			continue;
+		files = erealloc(files, (nfiles + 1) * sizeof(Diskfile));
+		files[nfiles].name = estrdup(de->d_name);
+		files[nfiles].mtime = st.st_mtim;
+		files[nfiles].size = st.st_size;
+		total += files[nfiles++].size;
+	}
+	closedir(dir);
+
+	qsort(files, nfiles, sizeof(Diskfile), disk_filecmp);
+	for (i = 0, over = total > diskcachemax; i < nfiles; i++) {
+		if (over && total > diskcachemax / 4 * 3) {
+			snprintf(path, sizeof(path), "%s/%s", cachedir, files[i].name);
+			if (unlink(path) == 0)
+				total -= files[i].size;
+		}
+		free(files[i].name);
+	}
+	free(files);
+	disksize = total;
+}
+
+/*
+ * Prefetch functions
+ *
+ * Links on screen are fetched into the cache, up to
+ * PREFETCHJOBS at a time, those followed most often from
+ * the page before others. Nothing here blocks: lookups are
+ * waited for and connections made by run().
+ */
+void
+follow_add(Elem *from, Elem *to) {
+	Follow *f, *prev;
+	char *uri = estrdup(elemtouri(from));
+
+	for (prev = NULL, f = follows.head; f; prev = f, f = f->next) {
+		if (strcmp(f->from, uri) == 0 && strcmp(f->to, elemtouri(to)) == 0) {
+			if (prev) {
+				prev->next = f->next;
+				f->next = follows.head;
+				follows.head = f;
+			}
+			f->count++;
+			free(uri);
+			return;
+		}
+	}
+
+	if (follows.len >= FOLLOWS) {
+		for (prev = NULL, f = follows.head; f->next; prev = f, f = f->next);
+		prev->next = NULL;
+		free(f->from);
+		free(f->to);
+		free(f);
+		follows.len--;
+	}
+
+	f = emalloc(sizeof(Follow));
+	f->from = uri;
+	f->to = estrdup(elemtouri(to));
+	f->count = 1;
+	f->next = follows.head;
+	follows.head = f;
+	follows.len++;
+}
+
+/* How many times to has been followed from the page at uri from */
+size_t
+follow_count(char *from, Elem *to) {
+	Follow *f;
+	char *uri = elemtouri(to);
+
+	for (f = follows.head; f; f = f->next)
+		if (strcmp(f->from, from) == 0 && strcmp(f->to, uri) == 0)
+			return f->count;
+	return 0;
+}
+
+/* Bytes fetched for pre.from, counting the jobs still going */
+size_t
+prefetch_used(void) {
+	Prefetch *p;
+	size_t ret = pre.used;
+
+	for (p = pre.jobs; p < pre.jobs + PREFETCHJOBS; p++)
+		if (p->e)
+			ret += list_size(&p->page);
+	return ret;
+}
+
+/* Starts fetching the next links, if there are any. The
+ * connections are then made and read by run() with
+ * prefetch_read(). */
+void
+prefetch_next(void) {
+	Prefetch *p;
+	Elem *e, *best;
+	size_t i, n, bestn;
+	char *uri;
+
+	pre.resolving = 0;
+	if (!prefetch || pre.active == PREFETCHJOBS || !current)
+		return;
+
+	uri = elemtouri(current);
+	if (!pre.from || strcmp(pre.from, uri) != 0) {
+		free(pre.from);
+		pre.from = estrdup(uri);
+		pre.used = pre.ntried = 0;
+	}
+
+	for (p = pre.jobs; p < pre.jobs + PREFETCHJOBS && prefetch_used() < prefetchmax; p++) {
+		if (p->e)
+			continue;
+
+		for (best = NULL, bestn = 0, i = ui.scroll;
+				i < (size_t)(ui.scroll + LINES - 1) && i < list_len(&page); i++) {
+			e = list_get(&page, i);
+			if ((e->type != '0' && e->type != '1') || !e->id || !e->server || !e->port)
+				continue;
+			for (n = 0; n < pre.ntried && pre.tried[n] != e->id; n++);
+			if (n < pre.ntried || cache_find(e))
+				continue;
+			/* such as a link home: reloading refetches it anyway */
+			if (strcmp(elemtouri(e), pre.from) == 0)
+				continue;
+			if ((n = follow_count(pre.from, e) + 1) > bestn) {
+				best = e;
+				bestn = n;
+			}
+		}
+
+		if (!best)
+			return;
+		if (net_resolve(best)) {
+			pre.resolving = 1;
+			return;
+		}
+
+		pre.tried = erealloc(pre.tried, (pre.ntried + 1) * sizeof(size_t));
+		pre.tried[pre.ntried++] = best->id;
+		if (net_dialstart(&p->dial, best) == -1)
+			continue;
+
+		p->e = elem_dup(best);
+		p->conn = NULL;
+		p->sent = 0;
+		p->gotall = 0;
+		pre.active++;
+		prefetch_read(p);
+	}
+}
+
+/* Called by run() when p's connection is ready, or while
+ * it's being made, whenever run() wakes up. */
+void
+prefetch_read(Prefetch *p) {
+	int fd, ret;
+
+	if (!p->conn) {
+		if ((fd = net_dialstep(&p->dial)) == NET_AGAIN)
+			return;
+		net_dialend(&p->dial);
+		if (fd == -1 || (p->conn = net_start(p->e, fd, 1)) == NULL) {
+			prefetch_end(p, 0);
+			return;
+		}
+	}
+
+	if (!p->sent) {
+		if ((ret = net_handshake(p->conn, 1)) == -1) {
+			prefetch_end(p, 0);
+			return;
+		}
+		if ((p->events = ret))
+			return;
+		net_write(p->conn, p->e->selector, strlen(p->e->selector));
+		net_write(p->conn, "\r\n", 2);
+		readline_reset(p->conn, &p->page.arena, NULL, 0);
+		p->events = POLLIN;
+		p->sent = 1;
+		return;
+	}
+
+	if ((ret = page_read(p->conn, p->e, &p->page, &p->gotall))) {
+		prefetch_end(p, ret == 1);
+	} else if (prefetch_used() > prefetchmax) {
+		pre.used = prefetchmax; /* nothing more for this page */
+		prefetch_end(p, 0);
+	}
+}
+
+/* Adds p to fds for run() to poll, returning how many were
+ * added, and lowers *wait to when it next needs checking. */
+size_t
+prefetch_poll(Prefetch *p, struct pollfd *fds, int *wait) {
+	int w;
+
+	if (p->conn) {
+		fds[0].fd = p->conn->fd;
+		fds[0].events = p->events;
+		return 1;
+	}
+
+	memcpy(fds, p->dial.pfds, p->dial.started * sizeof(struct pollfd));
+	w = net_dialwait(&p->dial);
+	if (*wait == -1 || w < *wait)
+		*wait = w;
+	return p->dial.started;
+}
+
+/* Stops fetching p, keeping the page
+ * in the cache if it was complete. */
+void
+prefetch_end(Prefetch *p, int complete) {
+	if (!p->e)
+		return;
+
+	if (p->conn)
+		net_close(p->conn);
+	else
+		net_dialend(&p->dial);
+	p->conn = NULL;
+	pre.active--;
+	if (complete && (p->gotall || p->e->type == '0')) {
+		pre.used += list_size(&p->page);
+		cache_put(p->e, &p->page, 0);
+	} else {
+		list_free(&p->page);
+	}
+	elem_free(p->e);
+	p->e = NULL;
+}
+
+/* If e is being fetched in the background, makes it the
+ * page, to be read by run() from now on. If it's still
+ * connecting, it's left for go() to fetch instead. */
+int
+prefetch_adopt(Elem *e) {
+	Prefetch *p;
+	char *uri;
+
+	if (!pre.active)
+		return 0;
+
+	uri = estrdup(elemtouri(e));
+	for (p = pre.jobs; p < pre.jobs + PREFETCHJOBS; p++)
+		if (p->e && strcmp(elemtouri(p->e), uri) == 0)
+			break;
+	free(uri);
+	if (p == pre.jobs + PREFETCHJOBS)
+		return 0;
+	if (!p->sent) {
+		prefetch_end(p, 0);
+		return 0;
+	}
+
+	cache_leave(e);
+	page = p->page;
+	memset(&p->page, 0, sizeof(List));
+	fetch.conn = p->conn;
+	fetch.conn->arena = &page.arena;
+	fetch.active = 1;
+	fetch.gotall = p->gotall;
+	fetch.tls = p->conn->tls;
+	fetch.handshake = p->conn->handshake;
+	fetch.resumed = p->conn->resumed;
+	ui.scroll = 0;
+
+	p->conn = NULL;
+	pre.active--;
+	elem_free(p->e);
+	p->e = NULL;
+	return 1;
+}
+
+/*
+ * Full-text index functions
+ *
+ * Each word on the pages visited maps to the ids of the pages
+ * it's on. Ids only grow, so the lists are in order and a page
+ * is only added to the end of one. Once the index is bigger
+ * than indexmax, the oldest pages are dropped from it. A big
+ * page only has its first words indexed, so it can't push out
+ * every other page.
+ */
+#define WORDCHAR(c) ((c) >= 0x80 || isalnum(c))
+
+/* Copies the next word of two or more characters from *p to
+ * buf, in lowercase, and returns its length, or 0 at the end */
+size_t
+index_word(const char **p, char *buf) {
+	const unsigned char *s = (const unsigned char *)*p;
+	size_t len = 0;
+
+	while (len < 2) {
+		while (*s && !WORDCHAR(*s))
+			s++;
+		if (!*s)
+			break;
+		for (len = 0; *s && WORDCHAR(*s); s++)
+			if (len < INDEXWORDLEN)
+				buf[len++] = tolower(*s);
+	}
+
+	*p = (const char *)s;
+	if (len < 2)
+		return 0;
+	buf[len] = '\0';
+	return len;
+}
+
+/* Returns where word is, or would be put, in the index */
+Word **
+index_lookup(const char *word) {
+	unsigned long long hash = 14695981039346656037ULL; /* FNV-1a */
+	const char *p;
+	Word **w;
+
+	for (p = word; *p; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 1099511628211ULL;
+	}
+
+	for (w = &fulltext.buckets[hash % fulltext.nbuckets]; *w; w = &(*w)->next)
+		if (strcmp((*w)->word, word) == 0)
+			break;
+	return w;
+}
+
+void
+index_grow(void) {
+	Word **old = fulltext.buckets, *w, *next;
+	size_t nold = fulltext.nbuckets, i;
+
+	fulltext.nbuckets = nold ? nold * 2 : INDEXBUCKETS;
+	fulltext.buckets = emalloc(fulltext.nbuckets * sizeof(Word *));
+	memset(fulltext.buckets, 0, fulltext.nbuckets * sizeof(Word *));
+	for (i = 0; i < nold; i++) {
+		for (w = old[i]; w; w = next) {
+			next = w->next;
+			w->next = NULL;
+			*index_lookup(w->word) = w;
+		}
+	}
+	fulltext.size += (fulltext.nbuckets - nold) * sizeof(Word *);
+	free(old);
+}
 
-	if (!l || !*l)
+/* Adds the words of l, the page for e, to the index. If it was
+ * already there, it's replaced if again is set, or left alone. */
+void
+index_page(Elem *e, List *l, int again) {
+	Indexed *p;
+	Word **w;
+	char buf[INDEXWORDLEN + 1], *uri;
+	const char *s;
+	unsigned int id;
+	size_t i, len, size, max;
+
+	if (!indexmax || !e || !e->server || !e->port || !list_len(l))
 		return;
-	for (prev = *l, p = prev->next; p; p = p->next) {
-		elem_free(prev);
-		prev = p;
+
+	uri = elemtouri(e);
+	for (p = fulltext.pages; p < fulltext.pages + fulltext.npages; p++) {
+		if (p->e && strcmp(p->uri, uri) == 0) {
+			if (!again)
+				return;
+			/* its words are dropped by index_trim() */
+			elem_free(p->e);
+			free(p->uri);
+			p->e = NULL;
+			p->uri = NULL;
+		}
 	}
-	*l = NULL;
+
+	if (!fulltext.nbuckets)
+		index_grow();
+
+	id = fulltext.base + fulltext.npages;
+	fulltext.pages = erealloc(fulltext.pages, (fulltext.npages + 1) * sizeof(Indexed));
+	p = &fulltext.pages[fulltext.npages++];
+	p->e = elem_dup(e);
+	p->uri = estrdup(uri);
+	size = sizeof(Indexed) + sizeof(Elem) + strlen(uri) * 2;
+	max = indexmax / INDEXPAGE;
+
+	for (i = 0; i < list_len(l) && size < max; i++) {
+		for (s = list_desc(l, i); s && size < max && (len = index_word(&s, buf)); ) {
+			if (!*(w = index_lookup(buf))) {
+				*w = emalloc(sizeof(Word));
+				memset(*w, 0, sizeof(Word));
+				(*w)->word = estrdup(buf);
+				fulltext.nwords++;
+				size += sizeof(Word) + len + 1;
+			}
+
+			if ((*w)->len && (*w)->pages[(*w)->len - 1] == id)
+				continue;
+			if ((*w)->len == (*w)->size) {
+				(*w)->size = (*w)->size ? (*w)->size * 2 : 4;
+				(*w)->pages = erealloc((*w)->pages, (*w)->size * sizeof(unsigned int));
+			}
+			(*w)->pages[(*w)->len++] = id;
+			size += sizeof(unsigned int);
+
+			if (fulltext.nwords > fulltext.nbuckets * 2)
+				index_grow();
+		}
+	}
+
+	p->size = size;
+	fulltext.size += size;
+	index_trim();
+}
+
+/* Drops the oldest pages until the index is well under
+ * indexmax, and with them any that were indexed again.
+ * The newest page is always kept. */
+void
+index_trim(void) {
+	Indexed *p;
+	Word **w, *next;
+	size_t i, j, k, drop, size;
+	unsigned int cut;
+
+	if (fulltext.size <= indexmax)
+		return;
+
+	for (size = fulltext.size, drop = 0; drop + 1 < fulltext.npages && size > indexmax / 4 * 3; drop++)
+		size -= fulltext.pages[drop].size;
+	cut = fulltext.base + drop;
+
+	fulltext.size = fulltext.nbuckets * sizeof(Word *);
+	for (i = 0; i < fulltext.nbuckets; i++) {
+		for (w = &fulltext.buckets[i]; *w; ) {
+			for (j = k = 0; j < (*w)->len; j++)
+				if ((*w)->pages[j] >= cut && fulltext.pages[(*w)->pages[j] - fulltext.base].e)
+					(*w)->pages[k++] = (*w)->pages[j];
+			if (((*w)->len = k)) {
+				fulltext.size += sizeof(Word) + strlen((*w)->word) + 1 + k * sizeof(unsigned int);
+				w = &(*w)->next;
+			} else {
+				next = (*w)->next;
+				free((*w)->word);
+				free((*w)->pages);
+				free(*w);
+				*w = next;
+				fulltext.nwords--;
+			}
+		}
+	}
+
+	for (p = fulltext.pages; p < fulltext.pages + drop; p++) {
+		elem_free(p->e);
+		free(p->uri);
+	}
+	fulltext.npages -= drop;
+	memmove(fulltext.pages, fulltext.pages + drop, fulltext.npages * sizeof(Indexed));
+	fulltext.base = cut;
+	for (p = fulltext.pages; p < fulltext.pages + fulltext.npages; p++)
+		fulltext.size += sizeof(Indexed) + (p->e ? sizeof(Elem) + strlen(p->uri) * 2 : 0);
+}
+
+int
+index_idcmp(const void *a, const void *b) {
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Appends links to the pages that have every word in query
+ * to l, most recently visited first. Returns how many. */
+size_t
+index_search(char *query, List *l) {
+	Word **words = NULL, *w;
+	Elem link;
+	Indexed *p;
+	char buf[INDEXWORDLEN + 1];
+	const char *s = query;
+	size_t nwords = 0, ret = 0, i, j;
+
+	if (!fulltext.nbuckets)
+		return 0;
+
+	while (index_word(&s, buf)) {
+		if (!(w = *index_lookup(buf))) {
+			free(words);
+			return 0;
+		}
+		/* shortest list first, others are searched */
+		words = erealloc(words, (nwords + 1) * sizeof(Word *));
+		for (i = nwords++; i > 0 && words[i - 1]->len > w->len; i--)
+			words[i] = words[i - 1];
+		words[i] = w;
+	}
+
+	for (i = nwords ? words[0]->len : 0; i > 0; i--) {
+		for (j = 1; j < nwords; j++)
+			if (!bsearch(&words[0]->pages[i - 1], words[j]->pages, words[j]->len,
+						sizeof(unsigned int), index_idcmp))
+				break;
+		p = &fulltext.pages[words[0]->pages[i - 1] - fulltext.base];
+		if (j < nwords || !p->e)
+			continue;
+
+		link = *p->e;
+		if (!link.desc || !*link.desc)
+			link.desc = p->uri;
+		list_append(l, &link);
+		ret++;
+	}
+
+	free(words);
+	return ret;
+}
+
+/*
+ * TLS capability functions
+ *
+ * Used by autotls to connect to hosts with whatever worked
+ * last time, instead of trying TLS first every time. They
+ * are saved in the cache directory, one per line:
+ *   <expiry time>\t<state>\t<server>\t<port>
+ */
+int
+tlscap_get(Elem *e) {
+	Tlscap *c;
+
+	for (c = tlscaps.head; c; c = c->next)
+		if (strcmp(c->server, e->server) == 0 && strcmp(c->port, e->port) == 0)
+			return c->expires > time(NULL) ? c->state : TLSCAP_UNKNOWN;
+	return TLSCAP_UNKNOWN;
+}
+
+void
+tlscap_set(Elem *e, int state) {
+	Tlscap *c, *prev;
+	time_t ttl = state == TLSCAP_FAILED ? TLSFAILTTL : TLSCAPTTL;
+	int save;
+
+	for (prev = NULL, c = tlscaps.head; c; prev = c, c = c->next) {
+		if (strcmp(c->server, e->server) == 0 && strcmp(c->port, e->port) == 0) {
+			if (prev) {
+				prev->next = c->next;
+				c->next = tlscaps.head;
+				tlscaps.head = c;
+			}
+			break;
+		}
+	}
+
+	/* Most calls just refresh a host that still works, which
+	 * is only saved once half its time is up, or at exit. */
+	save = !c || (int)c->state != state || c->expires - time(NULL) < ttl / 2;
+
+	if (!c) {
+		if (tlscaps.len >= TLSCAPS) {
+			for (prev = NULL, c = tlscaps.head; c->next; prev = c, c = c->next);
+			prev->next = NULL;
+			free(c->server);
+			free(c->port);
+			free(c);
+			tlscaps.len--;
+		}
+
+		c = emalloc(sizeof(Tlscap));
+		c->server = estrdup(e->server);
+		c->port = estrdup(e->port);
+		c->next = tlscaps.head;
+		tlscaps.head = c;
+		tlscaps.len++;
+	}
+
+	c->state = state;
+	c->expires = time(NULL) + ttl;
+	if (save)
+		tlscap_save();
+}
+
+/* Reads what tlscap_save() wrote last */
+void
+tlscap_load(void) {
+	FILE *f;
+	Tlscap *c, **tail;
+	char line[BUFLEN], *dir, *p, *server, *port;
+	long long expires;
+	size_t len;
+	long state;
+
+	if ((dir = dir_init()) == NULL)
+		return;
+	len = strlen(dir) + strlen("/" TLSCAPFILE) + 1;
+	tlscapfile = emalloc(len);
+	snprintf(tlscapfile, len, "%s/" TLSCAPFILE, dir);
+	free(dir);
+
+	if ((f = fopen(tlscapfile, "r")) == NULL)
+		return;
+
+	/* it's most recently used first too */
+	for (tail = &tlscaps.head; *tail; tail = &(*tail)->next);
+	while (tlscaps.len < TLSCAPS && fgets(line, sizeof(line), f)) {
+		expires = strtoll(line, &p, 10);
+		if (*p++ != '\t')
+			continue;
+		state = strtol(p, &p, 10);
+		if (*p++ != '\t' || (port = strchr((server = p), '\t')) == NULL)
+			continue;
+		*port++ = '\0';
+		port[strcspn(port, "\n")] = '\0';
+		if (expires <= time(NULL) || state <= TLSCAP_UNKNOWN || state > TLSCAP_PLAIN)
+			continue;
+
+		c = emalloc(sizeof(Tlscap));
+		c->server = estrdup(server);
+		c->port = estrdup(port);
+		c->state = state;
+		c->expires = expires;
+		c->next = NULL;
+		*tail = c;
+		tail = &c->next;
+		tlscaps.len++;
+	}
+	fclose(f);
+}
+
+/* Rewrites the file read by tlscap_load(), through another
+ * so that nothing reading it sees only part of it. */
+void
+tlscap_save(void) {
+	FILE *f;
+	Tlscap *c;
+	char tmp[PATH_MAX];
+	time_t now = time(NULL);
+
+	if (!tlscapfile)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.%ld", tlscapfile, (long)getpid());
+	if ((f = fopen(tmp, "w")) == NULL)
+		return;
+	for (c = tlscaps.head; c; c = c->next)
+		if (c->expires > now)
+			fprintf(f, "%lld\t%d\t%s\t%s\n", (long long)c->expires,
+					c->state, c->server, c->port);
+	if (fclose(f) == EOF || rename(tmp, tlscapfile) == -1)
+		unlink(tmp);
+}
+
+/*
+ * Misc functions
+ */
+/* Starts reading a new response from c into a, either
+ * from the connection, or from src if it isn't NULL. */
+void
+readline_reset(Conn *c, Arena **a, const char *src, size_t srclen) {
+	c->arena = a;
+	c->buf = NULL;
+	c->size = c->pos = c->len = 0;
+	c->src = src;
+	c->srclen = srclen;
+	c->eof = 0;
+	c->spool = 0;
+}
+
+/* Returns the next line (without the '\n') from c, or
+ * NULL if there isn't a whole line yet, or once the
+ * connection is closed (in which case c->eof is set to 1,
+ * or to -1 if it was closed by an error).
+ * The buffer is carved out of the arena given to
+ * readline_reset() and lines are returned in place, so
+ * a page's strings are the response itself. */
+char *
+readline(Conn *c, size_t *len) {
+	char *ret, *nl, *p;
+	size_t scan = c->pos;
+	size_t size, partial;
+	int n;
+
+	for (;;) {
+		if (c->len > scan && (nl = memchr(c->buf + scan, '\n', c->len - scan))) {
+			*nl = '\0';
+			ret = c->buf + c->pos;
+			*len = nl - ret;
+			c->pos = nl - c->buf + 1;
+			return ret;
+		}
+
+		/* Lines already returned can't move, so when the
+		 * block is full the partial line is copied to a new
+		 * one. That copy is the only one made of any line. */
+		if (c->size - c->len < READLEN / 2) {
+			partial = c->len - c->pos;
+			for (size = ARENALEN; size < partial + READLEN; size *= 2);
+			p = arena_alloc(c->arena, size);
+			if (partial)
+				memcpy(p, c->buf + c->pos, partial);
+			c->buf = p;
+			c->size = size;
+			c->pos = 0;
+			c->len = partial;
+		}
+		scan = c->len;
+
+		if (c->src) {
+			n = c->size - c->len - 1;
+			if ((size_t)n > c->srclen)
+				n = c->srclen;
+			memcpy(c->buf + c->len, c->src, n);
+			c->src += n;
+			c->srclen -= n;
+		} else if ((n = net_read(c, c->buf + c->len, c->size - c->len - 1)) == NET_AGAIN) {
+			return NULL;
+		} else if (n > 0 && c->spool && spool.fp) {
+			fwrite(c->buf + c->len, 1, n, spool.fp);
+			spool.size += n;
+		}
+
+		if (n < 1) {
+			c->eof = n == 0 ? 1 : -1;
+			if (c->len == c->pos)
+				return NULL;
+			/* last line wasn't terminated */
+			c->buf[c->len] = '\0';
+			ret = c->buf + c->pos;
+			*len = c->len - c->pos;
+			c->pos = c->len;
+			return ret;
+		}
+		c->len += n;
+	}
+}
+
+/* Reads as much of a response for e as is available
+ * from c into l with readline(). gotall is set when the menu
+ * terminator is seen. Returns 1 once the response ends,
+ * or -1 if it was cut short by an error. */
+int
+page_read(Conn *c, Elem *e, List *l, int *gotall) {
+	char *line;
+	size_t len;
+	Elem elem;
+
+	while ((line = readline(c, &len))) {
+		if (strcmp(line, ".\r") == 0) {
+			*gotall = 1;
+		} else {
+			if (len && line[len - 1] == '\r')
+				line[len - 1] = '\0';
+			/* line is already in l's arena */
+			if (e->type == '0') {
+				list_pushline(l, line);
+			} else {
+				gophertoelem(&elem, e, line);
+				list_push(l, &elem);
+			}
+		}
+	}
+
+	return c->eof;
+}
+
+/* Called by run() when the connection is readable */
+void
+fetch_read(void) {
+	size_t len = list_len(&page);
+	int ret;
+
+	if ((ret = page_read(fetch.conn, current, &page, &fetch.gotall)))
+		fetch_end(ret == 1);
+	else
+		draw_bar();
+
+	/* only redraw if new lines are visible */
+	if (len < (size_t)(ui.scroll + LINES - 1) && list_len(&page) > len)
+		draw_page();
+}
+
+/* Stops reading into page. If the response hadn't
+ * ended, what was received is kept, but not cached. */
+void
+fetch_end(int complete) {
+	Elem missing = {0, '3', "Full contents not received.", NULL, NULL, NULL, 0, NULL};
+
+	if (!fetch.active)
+		return;
+
+	fetch.active = 0;
+	page.partial = !complete;
+	if (!fetch.gotall && current->type != '0')
+		list_append(&page, &missing);
+	disk_finish(complete && (fetch.gotall || current->type == '0'));
+	index_page(current, &page, 1);
+	net_close(fetch.conn);
+	fetch.conn = NULL;
+	draw_page();
+	draw_bar();
+}
+
+/* Runs the plumber on arg, which is a uri or a file.
+ * Returns its pid if it isn't waited for, otherwise 0. */
+pid_t
+plumb(char *arg) {
+	pid_t pid;
+
+	if (!parallelplumb)
+		endwin();
+
+	if ((pid = fork()) == 0) {
+		if (parallelplumb) {
+			close(1);
+			close(2);
+		}
+		execlp(plumber, plumber, arg, NULL);
+	}
+	zygo_assert(pid != -1);
+
+	if (!parallelplumb) {
+		waitpid(pid, NULL, 0);
+		fprintf(stderr, "Press enter...");
+		getchar();
+		initscr();
+		return 0;
+	}
+	return pid;
+}
+
+/* Reaps plumbers that have exited, removing the downloads
+ * given to them. If all is set, the rest are removed too. */
+void
+plumb_reap(int all) {
+	pid_t pid;
+	size_t i;
+
+	childexited = 0;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0 || (all && dl.nplumbed)) {
+		for (i = 0; i < dl.nplumbed; i++) {
+			if (all || dl.plumbed[i].pid == pid) {
+				unlink(dl.plumbed[i].path);
+				free(dl.plumbed[i].path);
+				dl.plumbed[i--] = dl.plumbed[--dl.nplumbed];
+			}
+		}
+	}
+	if (all) {
+		free(dl.plumbed);
+		dl.plumbed = NULL;
+	}
+}
+
+/* Waits for the lookup of e->server, so that it can be
+ * cancelled with escape. Returns -1 if it was. Other keys
+ * pressed meanwhile are pushed back for run(). */
+int
+lookup(Elem *e) {
+	struct pollfd fds[2];
+	struct {
+		int ret; /* from get_wch() */
+		wint_t c;
+	} keys[LOOKUPKEYS];
+	int nkeys = 0, cancel = 0;
+	wint_t c;
+
+	while (!cancel && net_resolve(e)) {
+		/* once there are too many, escape goes unseen */
+		fds[0].fd = headless || nkeys == LOOKUPKEYS ? -1 : 0;
+		fds[1].fd = net_resolvefd();
+		fds[0].events = fds[1].events = POLLIN;
+		if (poll(fds, 2, -1) > 0 && fds[0].revents) {
+			timeout(0);
+			while (nkeys < LOOKUPKEYS && (keys[nkeys].ret = get_wch(&c)) != ERR) {
+				if (keys[nkeys].ret == OK && c == 27 /* escape */) {
+					cancel = 1;
+					break;
+				}
+				keys[nkeys++].c = c;
+			}
+			timeout(-1);
+		}
+	}
+
+	/* the last pushed back is read first */
+	while (nkeys--) {
+		if (keys[nkeys].ret == KEY_CODE_YES)
+			ungetch(keys[nkeys].c);
+		else
+			unget_wch(keys[nkeys].c);
+	}
+
+	if (cancel) {
+		error("lookup of %s cancelled", e->server);
+		return -1;
+	}
+	return 0;
 }
 
-void
-list_append(Elem **l, Elem *e) {
-	Elem *elem, *p;
+/* Starts downloading e to a temporary file, which is
+ * given to the plumber once run() has read all of it
+ * with download_read(). */
+int
+download_start(Elem *e) {
+	char *tmpdir, *base, *ext;
+	size_t len;
 
-	zygo_assert(l);
-	elem = elem_dup(e);
+	download_end(0);
 
-	if (!*l) {
-		(*l) = elem;
-		(*l)->len = 1;
-		(*l)->lastid = 0; /* incremented later */
-	} else {
-		for (p = *l; p && p->next; p = p->next);
-		p->next = elem;
-		(*l)->len++;
-	}
+	if (lookup(e) == -1 || (dl.conn = net_connect(e, 0)) == NULL)
+		return -1;
 
-	if (elem->type != 'i' && elem->type != '3')
-		elem->id = ++(*l)->lastid;
-}
+	/* keep the extension, the plumber may need it */
+	if (!(base = strrchr(e->selector, '/')))
+		base = e->selector;
+	if (!(ext = strrchr(base, '.')) || strlen(ext) > 16 || strpbrk(ext, "\t "))
+		ext = "";
+
+	if (!(tmpdir = getenv("TMPDIR")) || !*tmpdir)
+		tmpdir = "/tmp";
+	len = strlen(tmpdir) + strlen("/zygo.XXXXXX") + strlen(ext) + 1;
+	dl.path = emalloc(len);
+	snprintf(dl.path, len, "%s/zygo.XXXXXX%s", tmpdir, ext);
+	if ((dl.fd = mkstemps(dl.path, strlen(ext))) == -1) {
+		error("could not create %s: %s", dl.path, strerror(errno));
+		free(dl.path);
+		dl.path = NULL;
+		net_close(dl.conn);
+		dl.conn = NULL;
+		return -1;
+	}
 
-Elem *
-list_get(Elem **l, size_t elem) {
-	Elem *p;
-	if (!l || !(*l) || (*l)->len == 0 || elem >= (*l)->len)
-		return NULL;
-	for (p = *l; p && elem; elem--, p = p->next);
-	return p;
+	net_write(dl.conn, e->selector, strlen(e->selector));
+	net_write(dl.conn, "\r\n", 2);
+	fcntl(dl.conn->fd, F_SETFL, fcntl(dl.conn->fd, F_GETFL) | O_NONBLOCK);
+	dl.size = 0;
+	draw_bar();
+	return 0;
 }
 
-Elem *
-list_idget(Elem **l, size_t id) {
-	Elem *p;
-	if (!l || !(*l) || (*l)->len == 0 || id > (*l)->lastid)
-		return NULL;
-	for (p = *l; p && id; p = p->next)
-		if (p->type != 'i' && p->type != '3')
-			if (!--id)
-				break;
-	return p;
-}
+/* Called by run() when the download is readable */
+void
+download_read(void) {
+	char buf[READLEN];
+	int n;
+
+	while ((n = net_read(dl.conn, buf, sizeof(buf))) > 0) {
+		if (write(dl.fd, buf, n) != n) {
+			error("could not write %s: %s", dl.path, strerror(errno));
+			download_end(0);
+			return;
+		}
+		dl.size += n;
+	}
 
-size_t
-list_len(Elem **l) {
-	if (!l || !(*l))
-		return 0;
-	return (*l)->len;
+	if (n == NET_AGAIN)
+		draw_bar();
+	else
+		download_end(n == 0);
 }
 
+/* Stops the download, and plumbs the file if it's complete */
 void
-list_rev(Elem **l) {
-	Elem *p, *prev, *next;
-	size_t len, lastid;
+download_end(int complete) {
+	pid_t pid;
 
-	if (!l || !*l)
+	if (!dl.conn)
 		return;
 
-	len = (*l)->len;
-	lastid = (*l)->lastid;
-
-	for (p = *l, prev = NULL; p; p = next) {
-		next = p->next;
-		p->next = prev;
-		prev = p;
-		if (p->id)
-			p->id = lastid - p->id + 1;
-	}
-
-	prev->len = len;
-	prev->lastid = lastid;
-
-	*l = prev;
-}
-
-/*
- * Misc functions
- */
-int
-readline(char *buf, size_t count) {
-	size_t i = 0;
-	char c = 0;
+	net_close(dl.conn);
+	close(dl.fd);
+	dl.conn = NULL;
+	dl.fd = -1;
 
-	while (i < count && c != '\n') {
-		if (net_read(&c, sizeof(char)) < 1)
-			return 0;
-		buf[i++] = c;
+	if (complete && (pid = plumb(dl.path))) {
+		/* the plumber is still using it */
+		dl.plumbed = erealloc(dl.plumbed, (dl.nplumbed + 1) * sizeof(*dl.plumbed));
+		dl.plumbed[dl.nplumbed].pid = pid;
+		dl.plumbed[dl.nplumbed++].path = dl.path;
+	} else {
+		unlink(dl.path);
+		free(dl.path);
 	}
+	if (complete)
+		draw_page();
 
-	buf[i - 1] = '\0';
-	return 1;
+	dl.path = NULL;
+	draw_bar();
 }
 
+/* Shows e, from the cache if it's there, unless reload
+ * is set, in which case it's fetched unless that fails */
 int
-go(Elem *e, int mhist, int notls) {
-	char line[BUFLEN];
-	char *uri;
+go(Elem *e, int mhist, int notls, int reload) {
 	char *pstr;
-	Elem *elem;
 	Elem *dup = elem_dup(e); /* elem may be part of page */
-	Elem missing = {0, '3', "Full contents not received."};
+	Elem missing = {0, '3', "Full contents not received.", NULL, NULL, NULL, 0, NULL};
+	Cache *c;
+	Conn *conn, file;
+	Disk disk;
 	int ret;
 	int gotall = 0;
-	pid_t pid;
 
 	if (!e) return -1;
 
 	if (dup->type != '0' && dup->type != '1' && dup->type != '7' && dup->type != '+') {
-		/* call mario */
-		uri = elemtouri(e);
-
-		if (!parallelplumb)
-			endwin();
-
-		if ((pid = fork()) == 0) {
-			if (parallelplumb) {
-				close(1);
-				close(2);
-			}
-			execlp(plumber, plumber, uri, NULL);
+		if (plumbfetch && strchr(DOWNLOADTYPES, dup->type)) {
+			download_start(dup);
+			elem_free(dup);
+			return -1;
 		}
-		zygo_assert(pid != -1);
 
-		if (!parallelplumb) {
-			waitpid(pid, NULL, 0);
-			fprintf(stderr, "Press enter...");
-			fread(&line, sizeof(char), 1, stdin);
-			initscr();
-		}
+		/* call mario */
+		plumb(elemtouri(e));
+		elem_free(dup);
 		return -1;
 	}
 
@@ -471,10 +2032,22 @@ go(Elem *e, int mhist, int notls) {
 
 	move(LINES - 1, 0);
 	clrtoeol();
+#ifndef TLS
+	(void)notls;
+#endif /* TLS */
 #ifdef TLS
-	if (!dup->tls && autotls && !notls &&
-			(!current || strcmp(current->server, dup->server) != 0)) {
-		dup->tls = 1;
+	if (!dup->tls && autotls && !notls) {
+		switch (tlscap_get(dup)) {
+		case TLSCAP_WORKS:
+			dup->tls = 1;
+			break;
+		case TLSCAP_UNKNOWN:
+			if (!current || !current->server || strcmp(current->server, dup->server) != 0)
+				dup->tls = 1;
+			break;
+		}
+	}
+	if (dup->tls && !e->tls) {
 		printw("Attempting a TLS connection with %s:%s", dup->server, dup->port);
 	} else {
 #endif /* TLS */
@@ -484,58 +2057,162 @@ go(Elem *e, int mhist, int notls) {
 #endif /* TLS */
 	refresh();
 
-	if ((ret = net_connect(dup, e->tls != dup->tls)) == -1) {
+	fetch_end(0);
+
+	if (!reload && prefetch_adopt(dup))
+		goto loaded;
+
+	/* The page being shown is only in the cache if a link
+	 * to it was prefetched, which a reload mustn't use. */
+	if ((c = cache_get(dup)) && reload) {
+		cache_free(c);
+	} else if (c) {
+		cache_leave(dup);
+		page = c->page;
+		memset(&c->page, 0, sizeof(List));
+		ui.scroll = c->scroll;
+		cache_free(c);
+		fetch.tls = 0;
+		index_page(dup, &page, 0);
+		goto loaded;
+	}
+
+	/* still looked up when reloading, in case the server can't be reached */
+	if (disk_get(dup, &disk) == 0 && !reload &&
+			time(NULL) - disk.fetched < disk_ttl(dup->type))
+		goto fromdisk;
+
+	if (lookup(dup) == -1) {
+		disk_unmap(&disk);
+		elem_free(dup);
+		return -1;
+	}
+
+	if ((conn = net_connect(dup, e->tls != dup->tls)) == NULL) {
+		ret = -1;
+#ifdef TLS
+		if (dup->tls)
+			tlscap_set(dup, TLSCAP_FAILED);
+#endif /* TLS */
 		if (dup->tls && dup->tls == e->tls) {
 			timeout(stimeout * 1000);
 			pstr = prompt("TLS failed. Retry in cleartext (y/n)? ", 1);
 			if (pstr && tolower(*pstr) == 'y') {
 				dup->tls = 0;
 				ui.error = 0; /* hide the TLS error */
-				ret = go(dup, mhist, 1);
+				ret = go(dup, mhist, 1, reload);
 			}
 			timeout(-1);
 		} else if (dup->tls) {
 			dup->tls = 0;
-			ret = go(dup, mhist, 1);
+			ret = go(dup, mhist, 1, reload);
+		} else if (disk.map) {
+			error("could not connect to %s:%s, showing cached page", dup->server, dup->port);
+			goto fromdisk;
 		}
 
+		disk_unmap(&disk);
 		elem_free(dup);
 		return ret;
 	}
+	disk_unmap(&disk);
+#ifdef TLS
+	if (dup->tls)
+		tlscap_set(dup, TLSCAP_WORKS);
+	else if (tlscap_get(dup) == TLSCAP_FAILED)
+		tlscap_set(dup, TLSCAP_PLAIN); /* fell back */
+#endif /* TLS */
 
-	net_write(dup->selector, strlen(dup->selector));
-	net_write("\r\n", 2);
+	net_write(conn, dup->selector, strlen(dup->selector));
+	net_write(conn, "\r\n", 2);
+
+	cache_leave(dup);
+	readline_reset(conn, &page.arena, NULL, 0);
+	disk_start(dup);
+	conn->spool = 1;
+
+	/* run() reads the rest as it arrives */
+	fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+	fetch.conn = conn;
+	fetch.active = 1;
+	fetch.gotall = 0;
+	fetch.tls = dup->tls;
+	fetch.handshake = conn->handshake;
+	fetch.resumed = conn->resumed;
+	ui.scroll = 0;
+	goto loaded;
 
-	list_free(&page);
-	while (readline(line, sizeof(line))) {
-		if (strcmp(line, ".\r") == 0) {
-			gotall = 1;
-		} else {
-			if (line[strlen(line) - 1] == '\r')
-				line[strlen(line) - 1] = '\0';
-			if (dup->type == '0')
-				elem = elem_create(0, 'i', line, NULL, NULL, NULL);
-			else
-				elem = gophertoelem(dup, line);
-			list_append(&page, elem);
-			elem_free(elem);
-		}
-	}
+fromdisk:
+	cache_leave(dup);
+	readline_reset(&file, &page.arena, disk.body, disk.len);
+	while (!page_read(&file, dup, &page, &gotall));
+	disk_unmap(&disk);
 
 	if (!gotall && dup->type != '0')
 		list_append(&page, &missing);
+	fetch.tls = 0;
+	ui.scroll = 0;
+	index_page(dup, &page, 1);
 
+loaded:
 	elem_free(current);
 	current = dup;
 	if (mhist)
 		list_append(&history, current);
 
-	ui.scroll = 0;
-	if (ui.search) {
-		regfree(&ui.regex);
-		ui.search = 0;
+	search_free();
+	return 0;
+}
+
+/* Fetches e and writes it to stdout for -d. Menus are
+ * written as gophermaps with only \n after each line,
+ * anything else as it's received. */
+int
+dump(Elem *e) {
+	Conn *c;
+	Elem *m;
+	char buf[READLEN];
+	size_t i;
+	int n, gotall = 0;
+
+	if (lookup(e) == -1 || (c = net_connect(e, 0)) == NULL)
+		return -1;
+
+	net_write(c, e->selector, strlen(e->selector));
+	net_write(c, "\r\n", 2);
+
+	if (e->type != '1' && e->type != '7' && e->type != '+') {
+		while ((n = net_read(c, buf, sizeof(buf))) > 0 || n == NET_AGAIN)
+			if (n > 0)
+				fwrite(buf, 1, n, stdout);
+		net_close(c);
+		if (n == -1) {
+			error("could not read from %s:%s", e->server, e->port);
+			return -1;
+		}
+		return 0;
+	}
+
+	readline_reset(c, &page.arena, NULL, 0);
+	while (!(n = page_read(c, e, &page, &gotall)));
+	net_close(c);
+	if (n == -1) {
+		error("could not read from %s:%s", e->server, e->port);
+		return -1;
+	}
+
+	for (i = 0; i < list_len(&page); i++) {
+		m = list_get(&page, i);
+		printf("%c%s\t%s\t%s\t%s\n", m->type, m->desc ? m->desc : "",
+				m->selector ? m->selector : "",
+				m->server ? m->server : "",
+				m->port ? m->port : "");
 	}
 
+	if (!gotall) {
+		error("full contents not received");
+		return -1;
+	}
 	return 0;
 }
 
@@ -564,92 +2241,364 @@ error(char *format, ...) {
 	vsnprintf(ui.errorbuf, sizeof(ui.errorbuf), format, ap);
 	va_end(ap);
 
-	draw_bar();
+	if (headless)
+		fprintf(stderr, "zygo: %s\n", ui.errorbuf);
+	else
+		draw_bar();
 }
 
+/* Fills in schemes[] from scheme[] */
+void
+scheme_init(void) {
+	int i;
+
+	/* the first entry for a type wins, as
+	 * the list used to be searched in order */
+	for (i = 0; scheme[i].type != DEFL; i++)
+		if (!schemes[(unsigned char)scheme[i].type])
+			schemes[(unsigned char)scheme[i].type] = &scheme[i];
+	for (i = 0; i < 256; i++)
+		if (!schemes[i])
+			schemes[i] = &scheme[sizeof(scheme) / sizeof(scheme[0]) - 1];
+}
+
+/* Called once for each element as it's put in a list, the
+ * result is then in e->scheme */
 Scheme *
 getscheme(Elem *e) {
 	char type;
-	int i;
 
 	type = e->type;
-	if (type == 'h' && strstr(e->selector, "URL:"))
+	if (type == 'h' && e->selector && strstr(e->selector, "URL:"))
 		type = EXTR;
 
 	/* Try to get scheme from markdown header */
-	if (type == 'i' && mdhilight) {
+	if (type == 'i' && mdhilight && e->desc[0] == '#') {
 		/* 4+ matches MDH4 */
-		if (strncmp(e->desc, "####", 4) == 0)
-			type = MDH4;
-		else if (strncmp(e->desc, "###", 3) == 0)
-			type = MDH3;
-		else if (strncmp(e->desc, "##", 2) == 0)
-			type = MDH2;
-		else if (strncmp(e->desc, "#", 1) == 0)
+		if (e->desc[1] != '#')
 			type = MDH1;
+		else if (e->desc[2] != '#')
+			type = MDH2;
+		else if (e->desc[3] != '#')
+			type = MDH3;
+		else
+			type = MDH4;
 	}
 
-	for (i = 0; ; i++)
-		if (scheme[i].type == type || scheme[i].type == DEFL)
-			return &scheme[i];
+	return schemes[(unsigned char)type];
 }
 
+/* Checks the lines of page that haven't been yet, so
+ * the matches grow with the page as it's read */
 void
-find(int backward) {
-	enum {mfirst, mclose, mlast};
-	struct {
-		size_t pos;
-		int found;
-	} matches[] = {
-		[mfirst] = {.found = 0},
-		[mclose] = {.found = 0},
-		[mlast]  = {.found = 0},
-	};
+search_update(void) {
+	Matches *m = &ui.matches;
+	size_t len = list_len(&page);
 	size_t i;
-	size_t want;
-	Elem *e;
 
-	if (!ui.search) {
-		error("no search");
+	if (!ui.search || par.busy || m->scanned >= len)
+		return;
+
+	m->bits = erealloc(m->bits, (len + 7) / 8);
+	memset(m->bits + (m->scanned + 7) / 8, 0, (len + 7) / 8 - (m->scanned + 7) / 8);
+	if (len - m->scanned > SEARCHCHUNK) {
+		search_threaded(len);
 		return;
 	}
 
-	for (i = 0, e = page; i < list_len(&page); i++, e = e->next) {
-		if (regexec(&ui.regex, e->desc, 0, NULL, 0) == 0) {
-			matches[mlast].found = 1;
-			matches[mlast].pos = i;
-			if (!matches[mfirst].found) {
-				matches[mfirst].found = 1;
-				matches[mfirst].pos = i;
+	for (i = m->scanned; i < len; i++) {
+		if (match_exec(&ui.matcher, list_desc(&page, i))) {
+			m->bits[i / 8] |= 1 << (i % 8);
+			if (m->len == m->size) {
+				m->size = m->size ? m->size * 2 : 64;
+				m->pos = erealloc(m->pos, m->size * sizeof(size_t));
 			}
-			if (!matches[mclose].found && ((backward && i < ui.scroll) || (!backward && i > ui.scroll))) {
-				matches[mclose].found = 1;
-				matches[mclose].pos = i;
+			m->pos[m->len++] = i;
+		} else {
+			m->bits[i / 8] &= ~(1 << (i % 8));
+		}
+	}
+	m->scanned = len;
+}
+
+void *
+search_worker(void *arg) {
+	Matcher matcher;
+	Chunk *c;
+	size_t i;
+	char err[BUFLEN];
+
+	(void)arg;
+	/* a matcher may use regexec(), and while it's allowed on
+	 * one regex_t from many threads, some libcs lock it */
+	if (match_compile(&matcher, ui.pattern, regexflags, err, sizeof(err)) == -1)
+		return NULL;
+
+	pthread_mutex_lock(&par.lock);
+	while (par.next < par.nchunks) {
+		c = &par.chunks[par.next++];
+		pthread_mutex_unlock(&par.lock);
+
+		for (i = c->start; i < c->end; i++) {
+			if (match_exec(&matcher, list_desc(&page, i))) {
+				/* chunks start on a multiple of 8 (except the
+				 * first), so no two threads share a byte */
+				ui.matches.bits[i / 8] |= 1 << (i % 8);
+				if (c->len == c->size) {
+					c->size = c->size ? c->size * 2 : 64;
+					c->pos = erealloc(c->pos, c->size * sizeof(size_t));
+				}
+				c->pos[c->len++] = i;
 			}
 		}
+
+		pthread_mutex_lock(&par.lock);
+		c->done = 1;
+		pthread_cond_broadcast(&par.cond);
+	}
+	pthread_mutex_unlock(&par.lock);
+
+	match_free(&matcher);
+	return NULL;
+}
+
+/* Checks lines up to len with threads, each taking
+ * SEARCHCHUNK lines at a time. Chunks are merged in order
+ * as they finish, and if a search was just entered, the
+ * closest match is shown as soon as it's known. */
+void
+search_threaded(size_t len) {
+	Matches *m = &ui.matches;
+	pthread_t threads[SEARCHTHREADS];
+	size_t i, start, n;
+	long cpus;
+
+	par.nchunks = 0;
+	for (start = m->scanned; start < len; start = par.chunks[par.nchunks++].end) {
+		par.chunks = erealloc(par.chunks, (par.nchunks + 1) * sizeof(Chunk));
+		memset(&par.chunks[par.nchunks], 0, sizeof(Chunk));
+		par.chunks[par.nchunks].start = start;
+		par.chunks[par.nchunks].end = (start / SEARCHCHUNK + 1) * SEARCHCHUNK;
+		if (par.chunks[par.nchunks].end > len)
+			par.chunks[par.nchunks].end = len;
+	}
+	/* search_update() cleared the bytes after scanned */
+	for (i = m->scanned; i < len && i % 8; i++)
+		m->bits[i / 8] &= ~(1 << (i % 8));
+
+	if ((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		cpus = 1;
+	n = cpus < SEARCHTHREADS ? cpus : SEARCHTHREADS;
+	if (n > par.nchunks)
+		n = par.nchunks;
+
+	par.next = 0;
+	par.busy = 1;
+	for (i = 0; i < n; i++)
+		if (pthread_create(&threads[i], NULL, search_worker, NULL) != 0)
+			break;
+	n = i;
+	if (!n)
+		search_worker(NULL);
+
+	pthread_mutex_lock(&par.lock);
+	for (i = 0; i < par.nchunks; i++) {
+		while (!par.chunks[i].done)
+			pthread_cond_wait(&par.cond, &par.lock);
+		pthread_mutex_unlock(&par.lock);
+
+		if (m->len + par.chunks[i].len > m->size) {
+			m->size = m->len + par.chunks[i].len;
+			m->pos = erealloc(m->pos, m->size * sizeof(size_t));
+		}
+		if (par.chunks[i].len)
+			memcpy(m->pos + m->len, par.chunks[i].pos, par.chunks[i].len * sizeof(size_t));
+		m->len += par.chunks[i].len;
+		m->scanned = par.chunks[i].end;
+		free(par.chunks[i].pos);
+
+		if (ui.findpending && search_found(ui.findpending - 1)) {
+			find(ui.findpending - 1);
+			ui.findpending = 0;
+			draw_page();
+			refresh();
+		}
+
+		pthread_mutex_lock(&par.lock);
+	}
+	pthread_mutex_unlock(&par.lock);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	par.busy = 0;
+}
+
+/* Whether the matches so far are enough for find() */
+int
+search_found(int backward) {
+	Matches *m = &ui.matches;
+
+	if (!m->len)
+		return 0;
+	if (backward)
+		return m->scanned >= (size_t)ui.scroll && m->pos[0] < (size_t)ui.scroll;
+	return m->pos[m->len - 1] > (size_t)ui.scroll;
+}
+
+/* Forgets the matches, for when page is replaced */
+void
+search_reset(void) {
+	ui.matches.len = ui.matches.scanned = 0;
+}
+
+void
+search_free(void) {
+	if (!ui.search)
+		return;
+	match_free(&ui.matcher);
+	free(ui.pattern);
+	ui.pattern = NULL;
+	free(ui.matches.bits);
+	free(ui.matches.pos);
+	memset(&ui.matches, 0, sizeof(Matches));
+	ui.search = 0;
+}
+
+int
+search_matched(size_t line) {
+	search_update();
+	return ui.search && line < ui.matches.scanned &&
+		ui.matches.bits[line / 8] & (1 << (line % 8));
+}
+
+/* Scrolls to the next match after the top line (or the
+ * previous one before it), wrapping around the page. */
+void
+find(int backward) {
+	Matches *m = &ui.matches;
+	size_t lo, hi, mid;
+
+	if (!ui.search) {
+		error("no search");
+		return;
 	}
 
-	if (matches[mfirst].found == 0 &&
-			matches[mclose].found == 0 &&
-			matches[mlast].found == 0) {
+	search_update();
+	if (!m->len) {
 		error("no match");
 		return;
 	}
 
-	if (matches[mclose].found)
-		want = matches[mclose].pos;
-	else if (backward && matches[mlast].found)
-		want = matches[mlast].pos;
+	/* lo = first match after (or at, if backward) the top */
+	for (lo = 0, hi = m->len; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (m->pos[mid] < (size_t)ui.scroll + !backward)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (backward)
+		ui.scroll = m->pos[lo ? lo - 1 : m->len - 1];
 	else
-		want = matches[mfirst].pos;
+		ui.scroll = m->pos[lo < m->len ? lo : 0];
+}
+
+/* Returns desc as drawn on row y from column x: converted to
+ * wide characters, with tabs expanded and cut short to fit.
+ * This is kept until something else is drawn on the row, the
+ * terminal is resized, or the page is replaced (as its descs
+ * are freed, and another's could be at the same address). */
+Render *
+render_get(const char *desc, int y, int x) {
+	static int mark = -1;
+	Render *r;
+	mbstate_t ps;
+	const char *p;
+	wchar_t c, *w;
+	size_t k, len, cut;
+	int col, width, cutset;
+
+	if (y >= render.len) {
+		render.rows = erealloc(render.rows, (y + 1) * sizeof(Render));
+		memset(render.rows + render.len, 0, (y + 1 - render.len) * sizeof(Render));
+		render.len = y + 1;
+	}
+
+	r = &render.rows[y];
+	if (r->desc == desc && r->x == x && r->cols == COLS)
+		return r;
+
+	if (mark == -1) {
+		w = emalloc((strlen(toolong) + 1) * sizeof(wchar_t));
+		mbstowcs(w, toolong, strlen(toolong) + 1);
+		mark = wcswidth(w, strlen(toolong));
+		free(w);
+	}
+
+	free(r->wdesc);
+	r->desc = desc;
+	r->x = x;
+	r->cols = COLS;
+	r->truncated = 0;
+	/* each character is at least a byte, and the
+	 * columns tabs can add are bounded by COLS */
+	r->wdesc = emalloc((strlen(desc) + COLS + 1) * sizeof(wchar_t));
+
+	memset(&ps, 0, sizeof(ps));
+	for (p = desc, col = x, len = cut = 0, cutset = 0; *p; p += k) {
+		if ((k = mbrtowc(&c, p, MB_CUR_MAX, &ps)) == (size_t)-1 || k == (size_t)-2) {
+			memset(&ps, 0, sizeof(ps));
+			c = L'?';
+			k = 1;
+		}
+
+		if (c == L'\t') {
+			width = 8 - col % 8;
+		} else if ((width = wcwidth(c)) < 0) {
+			c = L'?';
+			width = 1;
+		}
+
+		/* the last place the marker would fit */
+		if (!cutset && col + width > COLS - mark) {
+			cut = len;
+			cutset = 1;
+		}
+		if (col + width > COLS) {
+			r->truncated = 1;
+			len = cut;
+			break;
+		}
+
+		col += width;
+		if (c == L'\t')
+			for (; width; width--)
+				r->wdesc[len++] = L' ';
+		else
+			r->wdesc[len++] = c;
+	}
 
-	ui.scroll = want;
+	r->wdesc[len] = L'\0';
+	r->len = len;
+	return r;
+}
+
+void
+render_flush(void) {
+	int i;
+
+	for (i = 0; i < render.len; i++)
+		free(render.rows[i].wdesc);
+	free(render.rows);
+	render.rows = NULL;
+	render.len = 0;
 }
 
 int
-draw_line(Elem *e, int nwidth) {
-	int y, x, len;
-	wchar_t *mbdesc, *p;
+draw_line(Elem *e, int nwidth, int hilight) {
+	Render *r;
+	int y, x;
 
 	if (nwidth)
 		attron(COLOR_PAIR(PAIR_EID));
@@ -657,76 +2606,87 @@ draw_line(Elem *e, int nwidth) {
 	if (e->type != 'i' && e->type != '3')
 		printw("%1$ *2$ld ", e->id, nwidth + 1);
 	else if (nwidth)
-		printw("%1$ *2$s ", "", nwidth + 1);
+		printw("%1$*2$s ", "", nwidth + 1);
 
 	if (nwidth) {
 		attroff(A_COLOR);
-		attron(COLOR_PAIR(getscheme(e)->pair));
-		printw("%s ", getscheme(e)->name);
+		attron(COLOR_PAIR(SCHEMEPAIR(e->scheme)));
+		printw("%s ", e->scheme->name);
 		attroff(A_COLOR);
 		printw("%s ", normsep);
 	} else {
 		attroff(A_COLOR);
 	}
 
-	if (ui.search && regexec(&ui.regex, e->desc, 0, NULL, 0) == 0)
+	if (hilight)
 		attron(A_REVERSE);
 
-	if (mdhilight && strncmp(e->desc, "#", 1) == 0) {
+	if (e->scheme->type >= MDH1 && e->scheme->type <= MDH4) {
 		attron(A_BOLD);
-		attron(COLOR_PAIR(getscheme(e)->pair));
+		attron(COLOR_PAIR(SCHEMEPAIR(e->scheme)));
 		attroff(A_BOLD);
 	}
 
-	len = mbstowcs(NULL, e->desc, 0) + 1;
-	mbdesc = emalloc(len * sizeof(wchar_t*));
-	mbstowcs(mbdesc, e->desc, len);
-
 	getyx(stdscr, y, x);
-	for (p = mbdesc; *p; p++) {
-		if (*p == L'\t')
-			x += 8;
-		else
-			x++;
-		if (x >= COLS) {
-			attron(A_REVERSE);
-			printw("%s", toolong);
-			goto end;
-		}
-		addnwstr(p, 1);
+	clrtoeol();
+	r = render_get(e->desc, y, x);
+	addnwstr(r->wdesc, r->len);
+	if (r->truncated) {
+		attron(A_REVERSE);
+		printw("%s", toolong);
 	}
 
-	printw("\n");
-end:
-	free(mbdesc);
 	attroff(A_REVERSE);
 	return y + 1;
 }
 
+/* Draws rows from up to (not including) to of the page */
 void
-draw_page(void) {
-	int y = 0, i;
-	int nwidth;
+draw_rows(int from, int to) {
+	int y, nwidth;
 	Elem *e;
 
 	attroff(A_COLOR);
-	if (page) {
-		if (!current || current->type != '0')
-			nwidth = digits(page->lastid);
+	if (!current || current->type != '0')
+		nwidth = digits(page.lastid);
+	else
+		nwidth = 0;
+
+	for (y = from; y < to; y++) {
+		move(y, 0);
+		if ((e = list_get(&page, ui.scroll + y)))
+			draw_line(e, nwidth, search_matched(ui.scroll + y));
 		else
-			nwidth = 0;
-		move(0, 0);
-		if (ui.scroll > list_len(&page))
-			ui.scroll = 0;
-		for (i = ui.scroll, e = list_get(&page, i); i <= list_len(&page) - 1 && y != LINES - 1; i++, e = e->next)
-			y = draw_line(e, nwidth);
-		for (; y < LINES - 1; y++) {
-			move(y, 0);
 			clrtoeol();
-		}
 	}
 }
 
+void
+draw_page(void) {
+	if (list_len(&page)) {
+		if ((size_t)ui.scroll > list_len(&page))
+			ui.scroll = 0;
+		draw_rows(0, LINES - 1);
+	}
+}
+
+/* Moves what is drawn of the page by lines, after ui.scroll
+ * has been, so only the rows that come into view are drawn.
+ * With idlok() the terminal does the rest by scrolling. */
+void
+draw_scroll(int lines) {
+	setscrreg(0, LINES - 2);
+	scrollok(stdscr, TRUE);
+	scrl(lines);
+	scrollok(stdscr, FALSE);
+	setscrreg(0, LINES - 1);
+
+	if (lines > 0)
+		draw_rows(LINES - 1 - lines, LINES - 1);
+	else
+		draw_rows(0, -lines);
+}
+
 void
 draw_bar(void) {
 	int savey, savex, x;
@@ -739,6 +2699,16 @@ draw_bar(void) {
 	}
 	attron(COLOR_PAIR(PAIR_BAR));
 	printw(" ");
+#ifdef TLS
+	if (current && fetch.tls)
+		printw("[tls %ldms%s, %ld/%ld resumed] ", fetch.handshake,
+				fetch.resumed ? " resumed" : "",
+				tlsstats.resumed, tlsstats.handshakes);
+#endif /* TLS */
+	if (fetch.active)
+		printw("[%zu lines] ", list_len(&page));
+	if (dl.conn)
+		printw("[%zu bytes] ", dl.size);
 	if (ui.error) {
 		curs_set(0);
 		attron(COLOR_PAIR(PAIR_ERR));
@@ -764,7 +2734,6 @@ void
 manpage(void) {
 	pid_t pid;
 	int status;
-	char buf;
 
 	endwin();
 
@@ -775,7 +2744,7 @@ manpage(void) {
 	waitpid(pid, &status, 0);
 	if (WEXITSTATUS(status) != 0) {
 		fprintf(stderr, "%s", "could not find manpage, press enter to continue...");
-		fread(&buf, sizeof(char), 1, stdin);
+		getchar();
 	}
 
 	initscr();
@@ -810,7 +2779,7 @@ char *
 prompt(char *prompt, size_t count) {
 	wint_t c;
 	int ret;
-	int x, y;
+	int x;
 
 	attrset(A_NORMAL);
 	input(0);
@@ -829,7 +2798,7 @@ start:
 			goto end;
 		} else if (c == KEY_BACKSPACE || c == 127) {
 			if (ui.input[0]) {
-				getyx(stdscr, y, x);
+				x = getcurx(stdscr);
 				move(LINES - 1, x - 1);
 				addch(' ');
 				move(LINES - 1, x - 1);
@@ -851,7 +2820,7 @@ end:
 
 Elem *
 strtolink(char *str) {
-	if (atoi(str) > page->lastid || atoi(str) < 0) {
+	if (atoi(str) < 0 || (size_t)atoi(str) > page.lastid) {
 		error("no such link: %s", str);
 		return NULL;
 	}
@@ -861,7 +2830,7 @@ strtolink(char *str) {
 
 void
 yank(Elem *e) {
-	char *uri, *sh;
+	char *uri;
 	int pfd[2];
 	int status;
 	pid_t pid;
@@ -881,41 +2850,49 @@ yank(Elem *e) {
 	}
 
 	close(pfd[0]);
-	write(pfd[1], uri, strlen(uri));
+	if (write(pfd[1], uri, strlen(uri)) == -1)
+		error("could not write to '%s' for yanking", yanker);
 	close(pfd[1]);
 
 	waitpid(pid, &status, 0);
 	if (WEXITSTATUS(status) != 0)
 		error("could not execute '%s' for yanking", yanker);
-
-	free(uri);
 }
 
 void
 pagescroll(int lines) {
-	if (lines > 0 && list_len(&page) > LINES - 1) {
+	int old = ui.scroll;
+
+	if (lines > 0 && list_len(&page) > (size_t)(LINES - 1)) {
 		ui.scroll += lines;
-		if (ui.scroll > list_len(&page) - LINES)
+		if ((size_t)ui.scroll > list_len(&page) - LINES)
 			ui.scroll = list_len(&page) - LINES + 1;
 	} else if (lines < 0) {
 		ui.scroll += lines;
 		if (ui.scroll < 0)
 			ui.scroll = 0;
 	} /* else intentionally left blank */
-	draw_page();
+
+	if (ui.scroll != old && abs(ui.scroll - old) < LINES - 1)
+		draw_scroll(ui.scroll - old);
+	else if (ui.scroll != old)
+		draw_page();
 }
 
 void
 idgo(size_t id) {
-	if (id > page->lastid || id < 1)
+	if (id > page.lastid || id < 1) {
 		error("no such link: %d", id);
-	else
-		go(list_idget(&page, id), 1, 0);
+	} else {
+		if (prefetch && current)
+			follow_add(current, list_idget(&page, id));
+		go(list_idget(&page, id), 1, 0, 0);
+	}
 }
 
 int
 wantnum(char cmd) {
-	return (!ui.cmd || ui.cmd == BIND_DISPLAY || ui.cmd == BIND_YANK);
+	return (!cmd || cmd == BIND_DISPLAY || cmd == BIND_YANK);
 }
 
 int
@@ -932,18 +2909,99 @@ void
 run(void) {
 	wint_t c;
 	int ret;
-	Elem *e;
+	size_t i;
+	Elem *e, hist;
+	List found;
 	char tmperror[BUFLEN];
+	struct pollfd *fds = NULL;
+	Prefetch **jobs = NULL;
+	nfds_t nfds, dli, resi, size;
+	int busy, wait;
 
 	draw_page();
 	draw_bar();
 
 	/* get_wch does refresh() for us */
-	while ((ret = get_wch(&c)) != ERR) {
+	for (;;) {
+		if (childexited)
+			plumb_reap(0);
+		if (!ui.wantinput)
+			prefetch_next();
+
+		/* While a page is being read, wait for either the
+		 * connection or the terminal, and only call get_wch
+		 * once it won't block. Input already buffered by
+		 * curses is picked up by trying it first anyway. */
+		busy = fetch.active || pre.active || pre.resolving || dl.conn;
+		timeout(busy ? 0 : -1);
+		if ((ret = get_wch(&c)) == ERR) {
+			if (!busy)
+				break;
+
+			/* one for each of stdin, dl, fetch and the
+			 * resolver, and any for the prefetches */
+			for (size = 4, i = 0; i < PREFETCHJOBS; i++)
+				if (pre.jobs[i].e)
+					size += pre.jobs[i].conn ? 1 : pre.jobs[i].dial.started;
+			fds = erealloc(fds, size * sizeof(struct pollfd));
+			jobs = erealloc(jobs, size * sizeof(Prefetch *));
+
+			jobs[0] = NULL;
+			fds[0].fd = 0;
+			fds[0].events = POLLIN;
+			nfds = 1;
+			dli = resi = 0;
+			wait = -1;
+			if (dl.conn) {
+				dli = nfds;
+				jobs[nfds] = NULL;
+				fds[nfds].fd = dl.conn->fd;
+				fds[nfds++].events = POLLIN;
+			}
+			if (fetch.active) {
+				jobs[nfds] = NULL;
+				fds[nfds].fd = fetch.conn->fd;
+				fds[nfds++].events = POLLIN;
+			}
+			if (pre.resolving && !ui.wantinput) {
+				/* prefetch_next() reads it */
+				resi = nfds;
+				jobs[nfds] = NULL;
+				fds[nfds].fd = net_resolvefd();
+				fds[nfds++].events = POLLIN;
+			}
+			for (i = 0; i < PREFETCHJOBS; i++) {
+				if (pre.jobs[i].e) {
+					ret = prefetch_poll(&pre.jobs[i], fds + nfds, &wait);
+					while (ret--)
+						jobs[nfds++] = &pre.jobs[i];
+				}
+			}
+			if (poll(fds, nfds, wait) >= 0) {
+				for (i = 1; i < nfds; i++) {
+					if (i == dli || i == resi) {
+						if (i == dli && fds[i].revents)
+							download_read();
+					} else if (!jobs[i]) {
+						if (fds[i].revents)
+							fetch_read();
+					} else if (jobs[i] == jobs[i - 1]) {
+						continue; /* another attempt at connecting */
+					} else if (!jobs[i]->conn || fds[i].revents) {
+						/* while connecting, it may be time
+						 * for the next attempt anyway */
+						prefetch_read(jobs[i]);
+					}
+				}
+			}
+			continue;
+		}
+
 		if (ui.error && c != KEY_RESIZE)
 			ui.error = 0;
 
 		if (c == KEY_RESIZE) {
+			render_flush();
 			draw_page();
 			draw_bar();
 		} else if (ui.wantinput) {
@@ -954,7 +3012,7 @@ submit:
 				switch (ui.cmd) {
 				case BIND_URI:
 					e = uritoelem(ui.arg);
-					go(e, 1, 0);
+					go(e, 1, 0, 0);
 					elem_free(e);
 					break;
 				case BIND_DISPLAY:
@@ -969,27 +3027,48 @@ submit:
 					break;
 				case BIND_SEARCH:
 				case BIND_SEARCH_BACK:
-					if (ui.search) {
-						regfree(&ui.regex);
-						ui.search = 0;
-					}
+					search_free();
 
 					if (ui.input[0] != '\0') {
-						if ((ret = regcomp(&ui.regex, ui.arg, regexflags)) != 0) {
-							regerror(ret, &ui.regex, (char *)&tmperror, sizeof(tmperror));
+						if (match_compile(&ui.matcher, ui.arg, regexflags,
+									(char *)&tmperror, sizeof(tmperror)) == -1) {
 							error("could not compile regex '%s': %s", ui.arg, tmperror);
 						} else {
 							ui.search = 1;
-							find(ui.cmd == BIND_SEARCH_BACK ? 1 : 0);
+							ui.pattern = estrdup(ui.arg);
+							ui.findpending = 1 + (ui.cmd == BIND_SEARCH_BACK);
+							search_update();
+							if (ui.findpending) {
+								ui.findpending = 0;
+								find(ui.cmd == BIND_SEARCH_BACK ? 1 : 0);
+							}
 						}
 					}
 					break;
+				case BIND_FULLTEXT:
+					memset(&found, 0, sizeof(List));
+					if (index_search(ui.arg, &found) == 0) {
+						list_free(&found);
+						error("no page visited has '%s'", ui.arg);
+						break;
+					}
+					fetch_end(0);
+					cache_put(current, &page, ui.scroll);
+					render_flush();
+					elem_free(current);
+					current = NULL;
+					page = found;
+					ui.scroll = 0;
+					search_reset();
+					draw_bar();
+					draw_page();
+					break;
 				case BIND_APPEND:
 					e = elem_dup(current);
 					e->selector = erealloc(e->selector, strlen(e->selector) + strlen(ui.arg) + 1);
 					/* should be safe.. I think */
 					strcat(e->selector, ui.arg);
-					go(e, 1, 0);
+					go(e, 1, 0, 0);
 					elem_free(e);
 					break;
 				case BIND_YANK:
@@ -1011,7 +3090,7 @@ submit:
 				yank(current);
 			} else if (acceptkey(ui.cmd, c)) {
 				input(c);
-				if (wantnum(ui.cmd) && atoi(ui.arg) * 10 > page->lastid)
+				if (wantnum(ui.cmd) && (size_t)atoi(ui.arg) * 10 > page.lastid)
 					goto submit;
 			}
 			draw_bar();
@@ -1044,13 +3123,9 @@ submit:
 				endwin();
 				exit(EXIT_SUCCESS);
 			case BIND_BACK:
-				if (history && history->next) {
-					for (e = history; e; e = e->next)
-						if (e->next && !e->next->next)
-							break;
-					go(e, 0, 0);
-					free(e->next);
-					e->next = NULL;
+				if (list_len(&history) > 1) {
+					go(list_get(&history, list_len(&history) - 2), 0, 0, 0);
+					list_pop(&history);
 					draw_page();
 					draw_bar();
 				} else {
@@ -1058,7 +3133,7 @@ submit:
 				}
 				break;
 			case BIND_RELOAD:
-				go(current, 0, 0);
+				go(current, 0, 0, 1);
 				draw_page();
 				draw_bar();
 				break;
@@ -1077,7 +3152,7 @@ submit:
 				e = elem_dup(current);
 				free(e->selector);
 				e->selector = strdup("");
-				go(e, 1, 0);
+				go(e, 1, 0, 0);
 				elem_free(e);
 				draw_page();
 				draw_bar();
@@ -1086,16 +3161,19 @@ submit:
 				manpage();
 				break;
 			case BIND_HISTORY:
-				if (history) {
+				if (list_len(&history)) {
+					fetch_end(0);
+					cache_put(current, &page, ui.scroll);
+					render_flush();
 					elem_free(current);
 					current = NULL;
-					list_free(&page);
-					for (e = history; e; e = e->next) {
-						free(e->desc);
-						e->desc = elemtouri(e);
-						list_append(&page, e);
+					for (i = 0; i < list_len(&history); i++) {
+						hist = *list_get(&history, i);
+						hist.desc = elemtouri(&hist);
+						list_append(&page, &hist);
 					}
 					list_rev(&page);
+					search_reset();
 					draw_bar();
 					draw_page();
 				} else {
@@ -1109,7 +3187,7 @@ submit:
 				ui.cmd = '\0';
 				input(0);
 				input(c);
-				if (atoi(ui.arg) * 10 > page->lastid) {
+				if ((size_t)atoi(ui.arg) * 10 > page.lastid) {
 					idgo(atoi(ui.arg));
 					ui.wantinput = 0;
 					draw_page();
@@ -1123,13 +3201,20 @@ submit:
 			case BIND_SEARCH_BACK:
 			case BIND_APPEND:
 			case BIND_YANK:
+			case BIND_FULLTEXT:
 				ui.cmd = (char)c;
 				ui.wantinput = 1;
 				input(0);
 				draw_bar();
 				break;
-			case '\n':
 			case 27: /* escape */
+				if (fetch.active || dl.conn) {
+					fetch_end(0);
+					download_end(0);
+					error("transfer cancelled");
+				}
+				break;
+			case '\n':
 			case KEY_BACKSPACE:
 				break;
 			default:
@@ -1138,13 +3223,17 @@ submit:
 			}
 		}
 	}
+
+	free(fds);
+	free(jobs);
 }
 
 void
 sighandler(int signal) {
 	switch (signal) {
 	case SIGCHLD:
-		while (waitpid(-1, NULL, WNOHANG) == 0);
+		/* run() reaps it, see plumb_reap() */
+		childexited = 1;
 		break;
 	}
 }
@@ -1152,9 +3241,9 @@ sighandler(int signal) {
 void
 usage(char *argv0) {
 #ifdef TLS
-#define OPTS "-Pv" TLSOPTS
+#define OPTS "-dPv" TLSOPTS
 #else
-#define OPTS "-Pv"
+#define OPTS "-dPv"
 #endif /* TLS */
 	fprintf(stderr, "usage: %s [%s] [-p plumber] [-y yanker] [uri]\n", basename(argv0), OPTS);
 	exit(EXIT_FAILURE);
@@ -1164,10 +3253,12 @@ usage(char *argv0) {
 int
 main(int argc, char *argv[]) {
 	Elem *target = NULL;
-	Elem err = {0, 0, NULL, NULL, NULL, NULL, 0};
+	Elem err = {0, 0, NULL, NULL, NULL, NULL, 0, NULL};
 	char *s;
 	int i;
 
+	scheme_init();
+
 	for (i = 1; i < argc; i++) {
 		if ((*argv[i] == '-' && *(argv[i]+1) == '\0') ||
 				(*argv[i] != '-' && target)) {
@@ -1181,6 +3272,9 @@ main(int argc, char *argv[]) {
 				}
 #endif /* TLS */
 				switch (*s) {
+				case 'd':
+					headless = 1;
+					break;
 				case 'k':
 					insecure = 1;
 					break;
@@ -1222,7 +3316,20 @@ main(int argc, char *argv[]) {
 		}
 	}
 
-	if (!page) {
+	if (headless) {
+		if (!target)
+			usage(argv[0]);
+		if (dump(target) == -1 || fflush(stdout) == EOF)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (diskcache)
+		disk_init();
+	if (autotls)
+		tlscap_load();
+
+	if (!list_len(&page)) {
 		if (ui.error) {
 			err.type = '3';
 			err.desc = ui.errorbuf;
@@ -1232,7 +3339,7 @@ main(int argc, char *argv[]) {
 			list_append(&page, &err);
 		}
 
-		for (i = 0; i < sizeof(start_page) / sizeof(start_page[0]); i++)
+		for (i = 0; i < (int)(sizeof(start_page) / sizeof(start_page[0])); i++)
 			list_append(&page, &start_page[i]);
 	}
 
@@ -1242,6 +3349,7 @@ main(int argc, char *argv[]) {
 	start_color();
 	use_default_colors();
 	keypad(stdscr, TRUE);
+	idlok(stdscr, TRUE);
 	set_escdelay(10);
 
 	signal(SIGALRM, sighandler);
@@ -1254,14 +3362,16 @@ main(int argc, char *argv[]) {
 	init_pair(PAIR_ERR, err_pair[0], err_pair[1]);
 	init_pair(PAIR_EID, eid_pair[0], eid_pair[1]);
 	for (i = 0; i == 0 || scheme[i - 1].type; i++) {
-		scheme[i].pair = i + PAIR_SCHEME;
-		init_pair(scheme[i].pair, scheme[i].fg, -1);
+		init_pair(SCHEMEPAIR(&scheme[i]), scheme[i].fg, -1);
 	}
 
 	if (target)
-		go(target, 1, 0);
+		go(target, 1, 0, 0);
 
 	run();
+	plumb_reap(1);
+	tlscap_save();
 
 	endwin();
+	return 0;
 }
@@ -18,10 +18,44 @@
  */
 
 #define BUFLEN 2048
+#define READLEN 16384 /* minimum size of a single read from the network */
+#define ARENALEN 65536 /* default size of an arena block */
+#define ARENAALIGN 16
+#define NET_AGAIN -2 /* net_read() on a non-blocking connection with no data */
+#define CONNDELAY 250 /* ms before racing the next address */
+#define CONNTIMEOUT 10000 /* ms before giving up on connecting */
+#define RESOLVERS 4 /* threads doing lookups */
+#define DNSCACHE 256 /* lookups to remember */
+#define DNSTTL (5 * 60 * 1000) /* ms to keep a lookup for */
+#define DNSNEGTTL (30 * 1000) /* ...or a failed one */
+#define LOOKUPKEYS 64 /* keys kept while waiting for a lookup */
+#define TLSSESSIONS 64 /* hosts to keep TLS sessions for */
+#define TLSCAPS 256 /* hosts to remember TLS support of */
+#define TLSCAPTTL (24 * 60 * 60) /* s to remember whether a host does TLS */
+#define TLSFAILTTL (10 * 60) /* ...or that an attempt failed */
+#define TLSCAPFILE "tlscaps" /* ...saved in the cache directory */
+#define FOLLOWS 1024 /* links followed to remember, for prefetching */
+#define PREFETCHJOBS 4 /* links to prefetch at once */
+#define DOWNLOADTYPES "459Igsd" /* types downloaded for the plumber */
+#define SEARCHCHUNK 65536 /* lines searched by a thread at a time */
+#define SEARCHTHREADS 8 /* at most, when more than a chunk is left */
+#define INDEXBUCKETS 4096 /* words in the full-text index before it grows */
+#define INDEXWORDLEN 32 /* bytes of a word that are indexed */
+#define INDEXPAGE 4 /* a page adds at most 1/INDEXPAGE of indexmax */
+#define MATCHPROG 1024 /* NFA instructions, longer patterns use regexec() */
+#define MATCHNODES 1024 /* ...and parsed nodes */
 #define zygo_assert(expr) (expr ? ((void)0) : (endwin(), assert(expr)))
-#define INFO(desc) {0, 'i', desc, NULL, NULL, NULL}
+#define INFO(desc) {0, 'i', desc, NULL, NULL, NULL, 0, NULL}
 #define LINK(type, desc, selector, server, port) \
-	{0, type, desc, selector, server, port}
+	{0, type, desc, selector, server, port, 0, NULL}
+
+typedef struct Arena Arena;
+struct Arena {
+	char *mem;
+	size_t used;
+	size_t size;
+	struct Arena *next; /* previous (full) block */
+};
 
 typedef struct Elem Elem;
 struct Elem {
@@ -34,20 +68,246 @@ struct Elem {
 	size_t id; /* only set when:
 		    * - type != 'i'
 		    * - in a list */
-	/* Following sizes only set when first in list */
+	struct Scheme *scheme; /* set in a list, see getscheme() */
+};
+
+typedef struct List List;
+struct List {
+	Elem *elems;
 	size_t len;
+	size_t size;
+	size_t *ids; /* ids[id - 1] is the index of link id */
 	size_t lastid;
-	struct Elem *next;
+	Arena *arena; /* owns the strings of every element */
+	int partial; /* transfer was cancelled */
+	char **lines; /* text documents: lines, instead of elems */
+};
+
+/* A connection, and the response read from it by readline().
+ * One without a connection reads the response from src. */
+typedef struct Conn Conn;
+struct Conn {
+	int fd;
+	int tls;
+	struct tls *ctx; /* tls.c only */
+	long started; /* tls.c: when the handshake started */
+	long handshake; /* ms the TLS handshake took */
+	int resumed; /* ...and whether it resumed a session */
+	Arena **arena; /* lines are returned from here */
+	char *buf;
+	size_t size;
+	size_t pos; /* start of unconsumed data */
+	size_t len; /* end of data */
+	const char *src;
+	size_t srclen;
+	int eof;
+	int spool; /* copy what's read to the disk cache */
+};
+
+/* Connection being made by net_dialstep() */
+typedef struct Dial Dial;
+struct Dial {
+	struct addrinfo *addrs; /* copied from the lookup, as it may expire */
+	size_t n;
+	struct pollfd *pfds; /* attempts started, fd is -1 once over */
+	size_t started;
+	size_t pending;
+	long next; /* when to start the next attempt */
+	long deadline;
+};
+
+/* Link being fetched in the background */
+typedef struct Prefetch Prefetch;
+struct Prefetch {
+	Elem *e; /* NULL if unused */
+	Dial dial; /* connecting, until conn is set */
+	Conn *conn;
+	int sent; /* handshake is done and the request sent */
+	short events; /* to poll conn for */
+	List page;
+	int gotall;
+};
+
+typedef struct Cache Cache;
+struct Cache {
+	char *uri; /* elemtouri() of the page */
+	List page;
+	int scroll;
+	size_t size;
+	struct Cache *prev;
+	struct Cache *next;
+};
+
+typedef struct Follow Follow;
+struct Follow {
+	char *from; /* elemtouri() of a page */
+	char *to; /* ...and of a link followed from it */
+	size_t count;
+	struct Follow *next;
+};
+
+typedef struct Disk Disk;
+struct Disk {
+	void *map;
+	size_t maplen;
+	char *body; /* response, within map */
+	size_t len;
+	time_t fetched;
+};
+
+typedef struct Diskfile Diskfile;
+struct Diskfile {
+	char *name;
+	struct timespec mtime;
+	size_t size;
+};
+
+typedef struct Expiry Expiry;
+struct Expiry {
+	char type;
+	long ttl; /* seconds */
 };
 
 enum { DEFL, EXTR,
 	MDH1, MDH2, MDH3, MDH4 };
+typedef struct Host Host;
+struct Host {
+	char *server;
+	char *port;
+	struct addrinfo *ai; /* NULL if the lookup failed */
+	long expires;
+	enum { HOST_QUEUED, HOST_RESOLVING, HOST_DONE } state;
+	struct Host *next;
+};
+
+typedef struct Session Session;
+struct Session {
+	char *server;
+	char *port;
+	int fd; /* unlinked file, see tls_config_set_session_fd() */
+	struct Session *next;
+};
+
+typedef struct Tlscap Tlscap;
+struct Tlscap {
+	char *server;
+	char *port;
+	enum { TLSCAP_UNKNOWN, TLSCAP_WORKS, TLSCAP_FAILED, TLSCAP_PLAIN } state;
+	time_t expires;
+	struct Tlscap *next;
+};
+
+typedef struct Tlsstats Tlsstats;
+struct Tlsstats {
+	long handshakes;
+	long resumed;
+};
+
+/* A word in the full-text index, see index_page() */
+typedef struct Word Word;
+struct Word {
+	char *word;
+	unsigned int *pages; /* ids of pages it's on, in order */
+	size_t len;
+	size_t size;
+	Word *next;
+};
+
+typedef struct Indexed Indexed;
+struct Indexed {
+	Elem *e; /* NULL if it was indexed again */
+	char *uri;
+	size_t size; /* bytes it added to the index */
+};
+
+typedef struct Matches Matches;
+struct Matches {
+	unsigned char *bits; /* a bit for each line of page */
+	size_t *pos; /* lines that match, in order */
+	size_t len;
+	size_t size;
+	size_t scanned; /* lines checked so far */
+};
+
+/* Part of a search done by search_worker() */
+typedef struct Chunk Chunk;
+struct Chunk {
+	size_t start;
+	size_t end;
+	size_t *pos; /* lines that match, in order */
+	size_t len;
+	size_t size;
+	int done;
+};
+
+/* Parsed search pattern, see match.c */
+typedef struct Renode Renode;
+struct Renode {
+	enum {
+		RE_EMPTY,
+		RE_SET, /* one of the bytes in set */
+		RE_BOL,
+		RE_EOL,
+		RE_CAT,
+		RE_ALT,
+		RE_REPEAT, /* l, min to max times (-1: no limit) */
+	} type;
+	unsigned char set[32];
+	int multibyte; /* set is followed by continuation bytes */
+	int min;
+	int max;
+	Renode *l;
+	Renode *r;
+};
+
+typedef struct Inst Inst;
+struct Inst {
+	enum {
+		I_SET, /* consume a byte in set */
+		I_CONT, /* ...or a UTF-8 continuation byte */
+		I_SPLIT, /* go to both x and y */
+		I_JMP, /* go to x */
+		I_BOL,
+		I_EOL,
+		I_MATCH,
+	} op;
+	unsigned char set[32];
+	int x;
+	int y;
+};
+
+typedef struct Matcher Matcher;
+struct Matcher {
+	enum {
+		MATCH_LITERAL,
+		MATCH_NFA,
+		MATCH_REGEX,
+	} kind;
+	int icase;
+	char *lit;
+	size_t litlen;
+	char first[3]; /* either case of lit[0], for strcspn() */
+	Inst *prog;
+	int nprog;
+	unsigned char start[32]; /* bytes a match can begin with */
+	regex_t regex;
+};
+
+typedef struct Render Render;
+struct Render {
+	const char *desc; /* NULL if unused */
+	int x; /* column it starts in */
+	int cols; /* COLS when it was made */
+	wchar_t *wdesc;
+	size_t len;
+	int truncated; /* toolong follows */
+};
+
 typedef struct Scheme Scheme;
 struct Scheme {
 	char type;
 	char *name;
 	short fg;
-	short pair;
 };
 
 enum {
@@ -60,46 +320,140 @@ enum {
 	PAIR_SCHEME = 7,
 };
 
-extern Elem *history;
-extern Elem *page;
+/* Colour pair of an entry of scheme[] */
+#define SCHEMEPAIR(s) ((s) - scheme + PAIR_SCHEME)
+
+extern List history;
+extern List page;
 extern Elem *current;
 extern int insecure;
+#ifdef TLS
+extern Tlsstats tlsstats;
+#endif /* TLS */
 
 /* Memory functions */
 void *emalloc(size_t size);
 void *erealloc(void *ptr, size_t size);
 char *estrdup(const char *str);
 
+/* Arena functions */
+void *arena_alloc(Arena **a, size_t size);
+void arena_unalloc(Arena **a, void *ptr, size_t size);
+void arena_free(Arena **a);
+
 /* Elem functions */
 void elem_free(Elem *e);
 Elem *elem_create(int tls, char type, char *desc, char *selector, char *server, char *port);
 Elem *elem_dup(Elem *e);
+size_t elem_arenasize(Elem *e);
+Elem *elem_arenadup(Arena **a, Elem *ret, Elem *e);
 Elem *uritoelem(const char *uri);
-Elem *gophertoelem(Elem *from, const char *line);
+Elem *gophertoelem(Elem *ret, Elem *from, char *line);
 char *elemtouri(Elem *e);
 
 /* List functions */
-void list_free(Elem **l);
-void list_append(Elem **l, Elem *e);
-Elem *list_get(Elem **l, size_t elem);
-Elem *list_idget(Elem **l, size_t id);
-void list_rev(Elem **l);
-size_t list_len(Elem **l);
-
-/* Network functions
- * only works with one fd/ctx at 
- * a time, reset at net_connect */
-int net_connect(Elem *e, int silent);
-int net_read(void *buf, size_t count);
-int net_write(void *buf, size_t count);
-int net_close(void);
+void list_free(List *l);
+void list_append(List *l, Elem *e);
+void list_push(List *l, Elem *e);
+void list_pushline(List *l, char *line);
+void list_pop(List *l);
+Elem *list_get(List *l, size_t elem);
+Elem *list_idget(List *l, size_t id);
+char *list_desc(List *l, size_t elem);
+void list_rev(List *l);
+size_t list_len(List *l);
+size_t list_size(List *l);
+
+/* Cache functions */
+void cache_unlink(Cache *c);
+void cache_free(Cache *c);
+void cache_put(Elem *e, List *l, int scroll);
+Cache *cache_find(Elem *e);
+Cache *cache_get(Elem *e);
+void cache_leave(Elem *e);
+
+/* Disk cache functions */
+char *dir_init(void);
+void disk_init(void);
+long disk_ttl(char type);
+char *disk_path(Elem *e);
+int disk_get(Elem *e, Disk *d);
+void disk_unmap(Disk *d);
+void disk_start(Elem *e);
+void disk_finish(int keep);
+int disk_filecmp(const void *a, const void *b);
+void disk_trim(void);
+
+/* Prefetch functions */
+void follow_add(Elem *from, Elem *to);
+size_t follow_count(char *from, Elem *to);
+size_t prefetch_used(void);
+void prefetch_next(void);
+void prefetch_read(Prefetch *p);
+size_t prefetch_poll(Prefetch *p, struct pollfd *fds, int *wait);
+void prefetch_end(Prefetch *p, int complete);
+int prefetch_adopt(Elem *e);
+
+/* Full-text index functions */
+size_t index_word(const char **p, char *buf);
+Word **index_lookup(const char *word);
+void index_grow(void);
+void index_page(Elem *e, List *l, int again);
+void index_trim(void);
+size_t index_search(char *query, List *l);
+
+/* TLS capability functions */
+int tlscap_get(Elem *e);
+void tlscap_set(Elem *e, int state);
+void tlscap_load(void);
+void tlscap_save(void);
+
+/* Network functions (net.c) */
+long net_ms(void);
+int net_resolvefd(void);
+int net_resolve(Elem *e);
+int net_dialstart(Dial *d, Elem *e);
+int net_dialstep(Dial *d);
+int net_dialwait(Dial *d);
+void net_dialend(Dial *d);
+int net_dial(Elem *e, int silent);
+
+/* Network functions (plain.c/tls.c) */
+Conn *net_connect(Elem *e, int silent);
+Conn *net_start(Elem *e, int fd, int silent);
+int net_handshake(Conn *c, int silent);
+int net_read(Conn *c, void *buf, size_t count);
+int net_write(Conn *c, void *buf, size_t count);
+int net_close(Conn *c);
+#ifdef TLS
+int net_session(Elem *e);
+struct tls_config *net_config(int silent);
+Conn *net_starttls(Elem *e, int fd, struct tls_config *cfg, int silent);
+#endif /* TLS */
+
+/* Search patterns */
+int match_compile(Matcher *m, const char *pattern, int flags, char *err, size_t errlen);
+int match_exec(Matcher *m, const char *str);
+void match_free(Matcher *m);
 
 /* UI functions */
 void error(char *format, ...);
+void scheme_init(void);
 Scheme *getscheme(Elem *e);
+void search_update(void);
+void *search_worker(void *arg);
+void search_threaded(size_t len);
+int search_found(int backward);
+void search_reset(void);
+void search_free(void);
+int search_matched(size_t line);
 void find(int backward);
-int draw_line(Elem *e, int nwidth);
+Render *render_get(const char *desc, int y, int x);
+void render_flush(void);
+int draw_line(Elem *e, int nwidth, int hilight);
+void draw_rows(int from, int to);
 void draw_page(void);
+void draw_scroll(int lines);
 void draw_bar(void);
 void input(int c);
 char *prompt(char *prompt, size_t count);
@@ -113,8 +467,19 @@ int acceptkey(char cmd, int key);
 void run(void);
 
 /* Misc */
-int readline(char *buf, size_t count);
-int go(Elem *e, int mhist, int notls);
+void readline_reset(Conn *c, Arena **a, const char *src, size_t srclen);
+char *readline(Conn *c, size_t *len);
+int page_read(Conn *c, Elem *e, List *l, int *gotall);
+void fetch_read(void);
+void fetch_end(int complete);
+pid_t plumb(char *arg);
+void plumb_reap(int all);
+int lookup(Elem *e);
+int download_start(Elem *e);
+void download_read(void);
+void download_end(int complete);
+int go(Elem *e, int mhist, int notls, int reload);
+int dump(Elem *e);
 int digits(int i);
 void sighandler(int signal);
 #ifdef ZYGO_STRLCAT